@@ -0,0 +1,154 @@
+#include "arena.hpp"
+#include "config.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+
+std::size_t Arena::pageSize(){
+    static std::size_t const page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+// rounds size up to whole pages
+static std::size_t roundToPages(std::size_t size){
+    std::size_t page_size = Arena::pageSize();
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+
+// size class of a range of size bytes: ranges of class c span 2^c pages
+unsigned Arena::sizeClass(std::size_t size){
+    std::size_t pages = roundToPages(size) / pageSize();
+    unsigned size_class = 0;
+    while ((std::size_t(1) << size_class) < pages){
+        size_class++;
+    }
+    return size_class;
+}
+
+
+// class of a block of size bytes: blocks of class c span SMALL_BLOCK_MIN << c bytes
+unsigned Arena::smallClass(std::size_t size){
+    unsigned small_class = 0;
+    while ((SMALL_BLOCK_MIN << small_class) < size){
+        small_class++;
+    }
+    return small_class;
+}
+
+
+// reserves size bytes of address space (at least min_size: if the reservation fails,
+// smaller sizes down to min_size are tried)
+Arena::Arena(std::size_t size, std::size_t min_size){
+    min_size = roundToPages(min_size);
+    size = roundToPages(size < min_size ? min_size : size);
+    while (true){
+        void* range = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (range != MAP_FAILED){
+            base = static_cast<char*>(range);
+            reserved = size;
+            return;
+        }
+        if (size == min_size){
+            return;
+        }
+        size = roundToPages(size / 2 < min_size ? min_size : size / 2);
+    }
+}
+
+// unmaps the whole range
+Arena::~Arena(){
+    if (base != NULL){
+        munmap(base, reserved);
+    }
+}
+
+
+// commits size bytes (rounded up to the size class) of zeroed memory, reusing a
+// released range of the same class if any.
+// Returns NULL if the arena is exhausted
+void* Arena::commit(std::size_t size){
+    if (isSmall(size)){
+        return commitSmall(size);
+    }
+    unsigned size_class = sizeClass(size);
+    {
+        std::unique_lock<std::mutex> lock(free_mutex);
+        if (!free_ranges[size_class].empty()){
+            void* start = free_ranges[size_class].back();
+            free_ranges[size_class].pop_back();
+            return start;
+        }
+    }
+    size = pageSize() << size_class;
+    // huge pages need a range aligned on the huge page size
+    bool huge = Config::get().huge_pages && size >= Config::HUGE_PAGE_SIZE;
+    std::size_t padding = huge ? Config::HUGE_PAGE_SIZE : 0;
+    std::size_t offset = end_offset.fetch_add(size + padding);
+    if (huge){
+        std::size_t misalignment = reinterpret_cast<std::size_t>(base + offset) % Config::HUGE_PAGE_SIZE;
+        offset += misalignment == 0 ? 0 : Config::HUGE_PAGE_SIZE - misalignment;
+    }
+    if (offset + size > reserved || offset + size < offset){
+        return NULL;
+    }
+    char* start = base + offset;
+    if (mprotect(start, size, PROT_READ | PROT_WRITE) != 0){
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge){
+        madvise(start, size, MADV_HUGEPAGE);
+    }
+#endif
+    return start;
+}
+
+// gives the pages of a committed range back to the kernel and puts the range in the
+// free list of its size class. The kernel zeroes the pages again on first touch
+void Arena::release(void* start, std::size_t size){
+    if (isSmall(size)){
+        releaseSmall(start, size);
+        return;
+    }
+    unsigned size_class = sizeClass(size);
+    madvise(start, pageSize() << size_class, MADV_DONTNEED);
+    std::unique_lock<std::mutex> lock(free_mutex);
+    free_ranges[size_class].push_back(start);
+}
+
+
+// a block is aligned on its size, which is at least twice the alignment of the words of a segment.
+// When the current slab has no room left for it, a new slab is committed (the rest of the
+// current one stays unused)
+void* Arena::commitSmall(std::size_t size){
+    unsigned small_class = smallClass(size);
+    std::size_t block_size = SMALL_BLOCK_MIN << small_class;
+    std::unique_lock<std::mutex> lock(small_mutex);
+    if (!free_blocks[small_class].empty()){
+        void* start = free_blocks[small_class].back();
+        free_blocks[small_class].pop_back();
+        return start;
+    }
+    std::size_t misalignment = reinterpret_cast<std::size_t>(slab_next) % block_size;
+    char* start = slab_next + (misalignment == 0 ? 0 : block_size - misalignment);
+    if (slab_next == NULL || start + block_size > slab_end){
+        std::size_t slab_size = SLAB_PAGES * pageSize();
+        char* slab = static_cast<char*>(commit(slab_size));
+        if (slab == NULL){
+            return NULL;
+        }
+        start = slab;
+        slab_end = slab + slab_size;
+    }
+    slab_next = start + block_size;
+    return start;
+}
+
+// the block is zeroed by hand: its pages are shared with other blocks
+void Arena::releaseSmall(void* start, std::size_t size){
+    unsigned small_class = smallClass(size);
+    memset(start, 0, SMALL_BLOCK_MIN << small_class);
+    std::unique_lock<std::mutex> lock(small_mutex);
+    free_blocks[small_class].push_back(start);
+}
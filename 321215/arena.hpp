@@ -0,0 +1,82 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// one large range of virtual address space, reserved PROT_NONE when the shared memory region
+// is created. Segments are carved out of it with a bump pointer and committed (made read/write)
+// on allocation; the kernel zeroes their pages lazily, on first touch.
+// Ranges are handed out by size class (a power of two number of pages); released ranges
+// go to the free list of their class and are reused before bumping.
+// Ranges of at most half a page are blocks of a power of two bytes instead, packed into
+// slabs of SLAB_PAGES pages committed at once, so small segments do not take a page each
+class Arena{
+    private:
+        static constexpr unsigned NUM_SIZE_CLASSES = 64;
+        static constexpr unsigned NUM_SMALL_CLASSES = 16;
+        static constexpr std::size_t SMALL_BLOCK_MIN = 64;
+        static constexpr std::size_t SLAB_PAGES = 16;
+
+        char* base = NULL;
+        std::size_t reserved = 0;
+
+        // offset of the first byte never handed out
+        std::atomic<std::size_t> end_offset{0};
+
+        std::mutex free_mutex;
+        // free_ranges[c] holds released ranges of 2^c pages, still committed, their pages
+        // given back to the kernel (so they read as zeros again)
+        std::vector<void*> free_ranges[NUM_SIZE_CLASSES];
+
+        std::mutex small_mutex;
+        // first free byte of the current slab and its end, the blocks of every small class are
+        // carved out of it (each aligned on its size)
+        char* slab_next = NULL;
+        char* slab_end = NULL;
+        // free_blocks[c] holds released blocks of SMALL_BLOCK_MIN << c bytes, zeroed again
+        std::vector<void*> free_blocks[NUM_SMALL_CLASSES];
+
+        // size class of a range of size bytes
+        static unsigned sizeClass(std::size_t size);
+
+        // whether a range of size bytes is a block of a slab
+        static bool isSmall(std::size_t size){
+            return size <= pageSize() / 2;
+        }
+
+        // class of a block of size bytes: blocks of class c span SMALL_BLOCK_MIN << c bytes
+        static unsigned smallClass(std::size_t size);
+
+        // commit and release of the blocks of slabs
+        void* commitSmall(std::size_t size);
+        void releaseSmall(void* start, std::size_t size);
+
+    public:
+        static std::size_t pageSize();
+
+        // reserves size bytes of address space (at least min_size: if the reservation fails,
+        // smaller sizes down to min_size are tried)
+        Arena(std::size_t size, std::size_t min_size);
+
+        // unmaps the whole range
+        ~Arena();
+
+        bool isReserved() const{
+            return base != NULL;
+        }
+
+        // commits size bytes (rounded up to the size class) of zeroed memory, reusing a
+        // released range (or block) of the same class if any.
+        // Returns NULL if the arena is exhausted
+        void* commit(std::size_t size);
+
+        // gives the pages of a committed range back to the kernel and puts the range in the
+        // free list of its size class. The kernel zeroes the pages again on first touch
+        // (a block of a slab is zeroed right away, the slab keeps its pages)
+        void release(void* start, std::size_t size);
+};
+
+#endif
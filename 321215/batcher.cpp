@@ -3,131 +3,521 @@
 #include "dual_stm.hpp"
 #include "word.hpp"
 #include "debug.hpp"
+#include "config.hpp"
 #include <iostream>
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <thread>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+Batcher::b_thread Batcher::idle_sentinel;
+
+// epoch of the last transaction ended by this thread, and its batcher. A read-only transaction
+// must not join that epoch (nor read a snapshot from before its end): it would miss the writes
+// its thread just committed, which are only applied when the epoch ends.
+// Epoch numbers of different batchers are unrelated: once the thread ended a transaction in another
+// batcher, its last epoch here is unknown and it does not join at all
+// (batchers are numbered from 1, 0 means none)
+static thread_local std::size_t left_epoch = 0;
+static thread_local std::uint64_t left_batcher = 0;
+
+static std::atomic<std::uint64_t> next_batcher_id{1};
+
+Batcher::Batcher(DualStm* i_dual_stm, EpochPolicy const& i_policy, bool i_multi_version):
+stm(i_dual_stm), id(next_batcher_id.fetch_add(1, std::memory_order_relaxed)), policy(i_policy), blocked(IDLE), self_commit(Config::get().self_commit), multi_version(i_multi_version){}
+
 
 Batcher::~Batcher(){
-    for (auto b : blocked){
-        delete b;
+    for (Transaction* tx = ended.load(); tx != nullptr; ){
+        Transaction* next = tx -> next_ended;
+        Transaction::release(tx);
+        tx = next;
     }
     for (auto tx : committed_transactions){
-        delete tx;
+        Transaction::release(tx);
     }
     for (auto tx : aborted_transactions){
-        delete tx;
+        Transaction::release(tx);
     }
 }
 
 
-Transaction* Batcher::enter(bool is_read_only){
-    std::unique_lock<std::mutex> lock(mutex);
-    if (remaining == 0){
-        remaining = 1;
-        Transaction * tx = new Transaction(counter, is_read_only, 1);
-        return tx;
+Transaction* Batcher::enter(bool is_read_only, bool exclusive){
+    if (multi_version && is_read_only && !exclusive){
+        Transaction* tx = beginSnapshot();
+        if (tx != nullptr){
+            return tx;
+        }
     }
-    else{
-        b_thread t;
-        t.thread_id = std::this_thread::get_id();
-        blocked.push_back(&t);
-        Transaction * tx = new Transaction(counter + 1, is_read_only, blocked.size());
-        while(!t.awake){
-            cv.wait(lock);
+
+    b_thread t;
+    t.is_read_only = is_read_only;
+    t.exclusive = exclusive;
+    b_thread* head = blocked.load(std::memory_order_acquire);
+    while (true){
+        if (head == IDLE){
+            // no epoch running: start one with this transaction alone
+            if (blocked.compare_exchange_weak(head, nullptr, std::memory_order_acq_rel, std::memory_order_acquire)){
+                std::size_t epoch = epochOf(state.load(std::memory_order_relaxed));
+                started.store(1, std::memory_order_relaxed);
+                joined.store(0, std::memory_order_relaxed);
+                // a read-write transaction alone in its epoch runs solo (but in multi-version mode,
+                // where it would overwrite the versions read by snapshots)
+                bool solo = !is_read_only && !multi_version;
+                state.store((std::uint64_t(epoch) << EPOCH_SHIFT) | (solo ? SOLO : 0) | 1, std::memory_order_release);
+                Transaction* tx = Transaction::acquire(epoch, is_read_only, 1);
+                tx -> solo = solo;
+                return tx;
+            }
+            continue;
+        }
+        if (is_read_only && !exclusive){
+            Transaction* tx = join();
+            if (tx != nullptr){
+                return tx;
+            }
+            head = blocked.load(std::memory_order_acquire);
+            if (head == IDLE){
+                continue;
+            }
+        }
+        // wait for the next epoch. The list is only ever pushed to or taken whole,
+        // so the compare and swap cannot suffer from ABA
+        t.next = head;
+        if (blocked.compare_exchange_weak(head, &t, std::memory_order_release, std::memory_order_acquire)){
+            break;
+        }
+    }
+
+    wait(&t);
+    Transaction* tx = Transaction::acquire(t.epoch, is_read_only, t.tr_num);
+    tx -> solo = t.solo;
+    return tx;
+}
+
+
+// read-only transaction joins the running epoch, if any, if the epoch is not solo, has not been
+// joined by as many transactions as it started with (nor is full for the policy), and if the
+// calling thread did not end a transaction in it nor, since, in another batcher. Returns NULL otherwise
+Transaction* Batcher::join(){
+    std::uint64_t s = state.load(std::memory_order_acquire);
+    bool may_join = left_batcher == id || left_batcher == 0;
+    while (may_join && remainingOf(s) != 0 && (s & SOLO) == 0 && epochOf(s) != left_epoch){
+        std::size_t num_joined = joined.load(std::memory_order_relaxed);
+        std::size_t num_started = started.load(std::memory_order_relaxed);
+        if (num_joined >= num_started || (policy.max_batch != 0 && num_started + num_joined >= policy.max_batch)){
+            break;
+        }
+        if (state.compare_exchange_weak(s, s + 1, std::memory_order_acq_rel, std::memory_order_acquire)){
+            joined.fetch_add(1, std::memory_order_relaxed);
+            // read-only transactions never claim a word, so they need no tr_num
+            return Transaction::acquire(epochOf(s), true, 0);
         }
-        return tx;
     }
+    return nullptr;
 }
 
 
 void Batcher::leave(Transaction* tx){
-    std::unique_lock<std::mutex> lock(mutex);
+    if (tx -> snapshot){
+        pins[tx -> pin_slot].store(0, std::memory_order_release);
+        Transaction::release(tx);
+        return;
+    }
+    DEBUG_MSG("Transaction " << tx->tr_num  << " from epoch " << tx->epoch << " is leaving batcher. Aborted: " << tx->aborted);
+    left_epoch = tx -> epoch;
+    left_batcher = id;
+    if (tx -> aborted){
+        tx -> undoAdds();
+    }
+    if (self_commit && !tx -> aborted && !tx -> written.empty()){
+        tx -> self_commit = true;
+        pending_commits.fetch_add(1, std::memory_order_relaxed);
+    }
+    Transaction* head = ended.load(std::memory_order_relaxed);
+    do{
+        tx -> next_ended = head;
+    } while (!ended.compare_exchange_weak(head, tx, std::memory_order_release, std::memory_order_relaxed));
+
+    // tx must not be used past this point, the closer may already have released it,
+    // unless it commits itself (the closer then waits for it)
+    std::uint64_t s = state.fetch_sub(1, std::memory_order_acq_rel);
     #ifdef DEBUG
 
-    if (remaining == 0){
-        DEBUG_MSG("Transaction " << tx->tr_num << " from epoch " << tx->epoch << "is leaving batcher. But remaining is 0!!!" );
+    if (remainingOf(s) == 0){
+        DEBUG_MSG("Transaction is leaving epoch " << epochOf(s) << ". But remaining is 0!!!" );
         std::cout << "Decreasing remaining when it is 0!!!"<<std::endl<<std::flush;
         throw std::runtime_error("Decreasing remaining when it is 0");
     }
 
     #endif
-    remaining --;
-    DEBUG_MSG("Transaction " << tx->tr_num  << " from epoch " << tx->epoch << " is leaving batcher. Aborted: " << tx->aborted << ".Remaining: " << remaining);
-    if(tx -> aborted == false){
-        committed_transactions.push_back(tx);
+    DEBUG_MSG("Remaining in epoch " << epochOf(s) << ": " << remainingOf(s) - 1);
+    if (remainingOf(s) == 1){
+        closeEpoch(epochOf(s), tx -> self_commit ? tx : NULL);
     }
-    else{
-        aborted_transactions.push_back(tx);
+    else if (tx -> self_commit){
+        waitClosed(epochOf(s));
+        tx -> commit();
+        pending_commits.fetch_sub(1, std::memory_order_release);
     }
-    if (remaining == 0){
-        DEBUG_MSG("Ending epoch " << counter);
+}
 
-        #ifdef DEBUG
-        if (committed_transactions.size() == 0){
-            std::cout << "No Committed transactions in epoch: " << counter <<std::endl<<std::flush;
-            throw std::runtime_error("No Committed transactions in this epoch!!!");
+
+// the snapshot must include the writes of the last transaction this thread ended here, so its
+// epoch must be completed. If the thread ended one in another region since, that epoch is unknown:
+// then the one running now (or being closed) must be completed. No epoch later than that one is
+// ever waited for
+Transaction* Batcher::beginSnapshot(){
+    std::size_t needed = 0;
+    if (left_batcher != 0){
+        bool idle = blocked.load(std::memory_order_acquire) == IDLE;
+        needed = epochOf(state.load(std::memory_order_acquire)) - (idle ? 1 : 0);
+        if (left_batcher == id && left_epoch < needed){
+            needed = left_epoch;
         }
-        #endif
+    }
+    while (completed.load(std::memory_order_acquire) < needed){
+        std::this_thread::yield();
+    }
 
-        onEpochEnd();
-        #ifdef DEBUG
-            stm -> checkEpochEnd();
-        #endif
+    // each thread starts looking for a free pin at its own place
+    std::size_t first = (reinterpret_cast<std::uintptr_t>(&left_epoch) >> 6) % MAX_PINS;
+    for (std::size_t k = 0; k < MAX_PINS; k++){
+        std::size_t slot = (first + k) % MAX_PINS;
+        std::size_t epoch = completed.load(std::memory_order_seq_cst);
+        std::size_t free_pin = 0;
+        if (!pins[slot].compare_exchange_strong(free_pin, epoch + 1, std::memory_order_seq_cst)){
+            continue;
+        }
+        // the closer publishes completed before looking at the pins: if it completed another epoch
+        // meanwhile, it may have missed the pin, which then moves to that snapshot
+        for (std::size_t now = completed.load(std::memory_order_seq_cst); now != epoch; now = completed.load(std::memory_order_seq_cst)){
+            epoch = now;
+            pins[slot].store(epoch + 1, std::memory_order_seq_cst);
+        }
+        Transaction* tx = Transaction::acquire(epoch, true, 0);
+        tx -> snapshot = true;
+        tx -> pin_slot = slot;
+        return tx;
+    }
+    return nullptr;
+}
 
-        counter ++;
 
-       
-        remaining = blocked.size();
-        if (remaining > 0){
-            DEBUG_MSG("Beginning epoch " << counter << " with " << blocked.size() << " transactions");
-            for (std::size_t i = blocked.size(); i > 0; i--){
-                blocked.back() -> awake = true;
-                blocked.pop_back(); 
-            }
-            cv.notify_all();
+// a segment freed at the end of epoch e can be recycled once every pinned snapshot is from e on
+void Batcher::recycleFreed(){
+    if (deferred_frees.empty()){
+        return;
+    }
+    std::size_t oldest = SIZE_MAX;
+    for (std::size_t i = 0; i < MAX_PINS; i++){
+        std::size_t pin = pins[i].load(std::memory_order_seq_cst);
+        if (pin != 0 && pin - 1 < oldest){
+            oldest = pin - 1;
+        }
+    }
+    std::size_t kept = 0;
+    for (auto const& freed : deferred_frees){
+        if (freed.second <= oldest){
+            stm -> freeSegment(freed.first);
         }
         else{
+            deferred_frees[kept++] = freed;
+        }
+    }
+    deferred_frees.resize(kept);
+}
+
+
+void Batcher::waitClosed(std::size_t epoch){
+    std::uint32_t closing = static_cast<std::uint32_t>(epoch);
+    std::size_t spins = Config::get().wait_spins;
+    std::uint32_t last_closed;
+    while ((last_closed = closed.load(std::memory_order_acquire)) != closing){
+        if (spins > 0){
+            spins --;
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+        }
+        else{
+            syscall(SYS_futex, &closed, FUTEX_WAIT_PRIVATE, last_closed, NULL, NULL, 0);
+        }
+    }
+}
+
+
+// the last transaction of the epoch has left, every other thread either waits in
+// blocked or sees remaining at 0 until the next epoch is started
+void Batcher::closeEpoch(std::size_t epoch, Transaction* own){
+    DEBUG_MSG("Ending epoch " << epoch);
+    for (Transaction* tx = ended.exchange(nullptr, std::memory_order_acquire); tx != nullptr; tx = tx -> next_ended){
+        if (tx -> aborted == false){
+            committed_transactions.push_back(tx);
+        }
+        else{
+            aborted_transactions.push_back(tx);
+        }
+    }
+
+    #ifdef DEBUG
+    if (committed_transactions.size() == 0){
+        std::cout << "No Committed transactions in epoch: " << epoch <<std::endl<<std::flush;
+        throw std::runtime_error("No Committed transactions in this epoch!!!");
+    }
+    #endif
+
+    if (pending_commits.load(std::memory_order_relaxed) > 0){
+        closed.store(static_cast<std::uint32_t>(epoch), std::memory_order_release);
+        syscall(SYS_futex, &closed, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        if (own != NULL){
+            own -> commit();
+            pending_commits.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // the threads waiting now, they cannot leave the list before the closer wakes them up
+    b_thread* waiting = blocked.load(std::memory_order_acquire);
+    onEpochEnd(waiting);
+    #ifdef DEBUG
+        stm -> checkEpochEnd(epoch);
+    #endif
+    completed.store(epoch, std::memory_order_seq_cst);
+    if (multi_version){
+        recycleFreed();
+    }
+
+    if (policy.min_batch > 1 && policy.gathering_window_us > 0){
+        gather();
+    }
+
+    std::uint64_t next_state = std::uint64_t(epoch + 1) << EPOCH_SHIFT;
+    b_thread* head = blocked.load(std::memory_order_acquire);
+    while (head != nullptr || queued.empty()){
+        if (head == nullptr){
             DEBUG_MSG("No transactions waiting to enter batcher");
+            state.store(next_state, std::memory_order_relaxed);
+            // publishes the new epoch number to the next thread starting an epoch
+            if (blocked.compare_exchange_strong(head, IDLE, std::memory_order_acq_rel, std::memory_order_acquire)){
+                return;
+            }
+            // a thread started waiting in the meantime
+            continue;
+        }
+        if (blocked.compare_exchange_weak(head, nullptr, std::memory_order_acq_rel, std::memory_order_acquire)){
+            break;
         }
     }
+
+    // the taken threads (newest first) are queued behind the ones left over, oldest first
+    std::size_t num_queued = queued.size();
+    for (b_thread* t = head; t != nullptr; t = t -> next){
+        queued.push_back(t);
+    }
+    std::reverse(queued.begin() + num_queued, queued.end());
+
+    std::size_t num_admitted = queued.size();
+    if (policy.max_batch != 0 && num_admitted > policy.max_batch){
+        num_admitted = policy.max_batch;
+    }
+    // an exclusive thread is admitted alone, the ones queued before it first
+    if (queued.front() -> exclusive){
+        num_admitted = 1;
+    }
+    else{
+        for (std::size_t i = 1; i < num_admitted; i++){
+            if (queued[i] -> exclusive){
+                num_admitted = i;
+                break;
+            }
+        }
+    }
+    assert(num_admitted <= WordControl::MAX_TR_NUM);
+    admitted.assign(queued.begin(), queued.begin() + num_admitted);
+    queued.erase(queued.begin(), queued.begin() + num_admitted);
+    for (std::size_t i = 0; i < num_admitted; i++){
+        admitted[i] -> tr_num = i + 1;
+        admitted[i] -> epoch = epoch + 1;
+    }
+    // a read-write transaction alone in its epoch runs solo (but in multi-version mode)
+    if (num_admitted == 1 && !admitted[0] -> is_read_only && !multi_version){
+        admitted[0] -> solo = true;
+        next_state |= SOLO;
+    }
+    DEBUG_MSG("Beginning epoch " << epoch + 1 << " with " << num_admitted << " transactions, " << queued.size() << " left waiting");
+
+    started.store(num_admitted, std::memory_order_relaxed);
+    joined.store(0, std::memory_order_relaxed);
+    state.store(next_state | num_admitted, std::memory_order_release);
+
+    // a waiting thread may return from enter (and pop its b_thread) as soon as it is woken up
+    for (b_thread* t : admitted){
+        wake(t);
+    }
+}
+
+
+void Batcher::gather(){
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(policy.gathering_window_us);
+    while (true){
+        std::size_t num_waiting = queued.size();
+        for (b_thread* t = blocked.load(std::memory_order_acquire); t != nullptr && num_waiting < policy.min_batch; t = t -> next){
+            num_waiting ++;
+        }
+        if (num_waiting == 0 || num_waiting >= policy.min_batch || std::chrono::steady_clock::now() >= deadline){
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+
+void Batcher::wait(b_thread* t){
+    std::size_t spins = Config::get().wait_spins;
+    while (true){
+        std::uint32_t wake_state = t -> wake_state.load(std::memory_order_acquire);
+        if (wake_state == AWAKE){
+            return;
+        }
+        if (wake_state == HELP){
+            helpCommit();
+            active_helpers.fetch_sub(1, std::memory_order_release);
+            // fails only if woken up meanwhile
+            if (!t -> wake_state.compare_exchange_strong(wake_state, WAITING, std::memory_order_acquire)){
+                return;
+            }
+        }
+        else if (spins > 0){
+            spins --;
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+        }
+        else if (wake_state == WAITING){
+            t -> wake_state.compare_exchange_strong(wake_state, SLEEPING, std::memory_order_acquire);
+        }
+        else{
+            // returns at once if wake_state is no longer SLEEPING, the loop handles spurious wakeups
+            syscall(SYS_futex, &t -> wake_state, FUTEX_WAIT_PRIVATE, SLEEPING, NULL, NULL, 0);
+        }
+    }
+}
+
+
+// once wake_state is AWAKE, t may be gone: the futex wake then targets a stale stack address,
+// at worst spuriously waking another futex at that address, which its waiter tolerates
+void Batcher::wake(b_thread* t){
+    if (t -> wake_state.exchange(AWAKE, std::memory_order_release) == SLEEPING){
+        syscall(SYS_futex, &t -> wake_state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
-// 1) add segments that were allocated by committed transactions to the STM
-// 2) update state of words that were accessed in this epoch 
-//    (for committed/non-committed transactions, on/off the STM)  
-// 3) free (on STM) segments that were freed by committed transactions
-// 4) delete all transactions and empty committed/aborted arrays
-void Batcher::onEpochEnd(){
-    DEBUG_MSG("Number comitted transactions: " << committed_transactions.size());
-    DEBUG_MSG("Number aborted transactions: " << aborted_transactions.size());
 
-    // add allocated segments
+// a helper asked late may find no chunk left
+void Batcher::helpCommit(){
+    std::size_t num_chunks = commit_chunks.size();
+    for (std::size_t i = next_chunk.fetch_add(1, std::memory_order_relaxed); i < num_chunks;
+            i = next_chunk.fetch_add(1, std::memory_order_relaxed)){
+        CommitChunk const& chunk = commit_chunks[i];
+        chunk.tx -> commit(chunk.begin, chunk.end);
+        chunks_done.fetch_add(1, std::memory_order_release);
+    }
+}
+
+
+// the transactions are split in chunks of COMMIT_CHUNK_WORDS written words. If there are several,
+// as many waiting threads as there are other chunks are asked for help
+void Batcher::commitChunks(b_thread* waiting){
+    commit_chunks.clear();
     for (Transaction* tx : committed_transactions){
-        for(auto it = tx->allocated.begin(); it != tx->allocated.end(); it++){
-            std::size_t start_addr = it->first;
-            Segment* sg = it->second;
-            stm->addSegment(start_addr, sg);
+        if (tx -> self_commit){
+            continue;
         }
+        std::size_t num_written = tx -> written.size();
+        for (std::size_t begin = 0; begin < num_written; begin += COMMIT_CHUNK_WORDS){
+            commit_chunks.push_back({tx, begin, std::min(begin + COMMIT_CHUNK_WORDS, num_written)});
+        }
+    }
+    if (commit_chunks.size() < 2 || waiting == nullptr){
+        for (CommitChunk const& chunk : commit_chunks){
+            chunk.tx -> commit(chunk.begin, chunk.end);
+        }
+        return;
     }
 
-    // update state of accessed words
-    for(Transaction* tx : committed_transactions){
-        //DEBUG_MSG("Updating state for " << tx->accessed.size() << " words accessed by committed tx: " << tx->tr_num << " has written: " << tx->has_written);
-        tx->commit();
+    next_chunk.store(0, std::memory_order_relaxed);
+    chunks_done.store(0, std::memory_order_relaxed);
+    std::size_t helpers = 0;
+    for (b_thread* t = waiting; t != nullptr && helpers + 1 < commit_chunks.size(); t = t -> next){
+        active_helpers.fetch_add(1, std::memory_order_relaxed);
+        // publishes the chunks to the helper
+        if (t -> wake_state.exchange(HELP, std::memory_order_release) == SLEEPING){
+            syscall(SYS_futex, &t -> wake_state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+        helpers ++;
     }
-    for(Transaction* tx : aborted_transactions){
-       // DEBUG_MSG("Updating state for " << tx->accessed.size() << " words accessed by aborted tx: " << tx->tr_num << " has written: " << tx->has_written);
-        tx->abort();
+    DEBUG_MSG("Committing " << commit_chunks.size() << " chunks with " << helpers << " helpers");
+    helpCommit();
+    // late helpers must be done with commit_chunks too before it is reused
+    while (chunks_done.load(std::memory_order_acquire) != commit_chunks.size()
+            || active_helpers.load(std::memory_order_acquire) != 0){
+        std::this_thread::yield();
+    }
+}
+
+// 1) swap readable/writable copy of the words added to in this epoch
+// 2) discard segments that were allocated by aborted transactions
+//    (the ones allocated by committed transactions are already in the segment table)
+// 3) swap readable/writable copy of the words written by committed transactions
+//    (the access state of every word accessed in this epoch becomes stale by itself)
+// 4) free (on STM) segments that were freed by committed transactions
+// 5) release all transactions to their thread's pool and empty committed/aborted arrays
+void Batcher::onEpochEnd(b_thread* waiting){
+    DEBUG_MSG("Number comitted transactions: " << committed_transactions.size());
+    DEBUG_MSG("Number aborted transactions: " << aborted_transactions.size());
+
+    // words added to, all the deltas of aborted transactions are already undone. Before the
+    // discards: the words of a discarded segment are released and must not be written any more
+    // (added words are never among the written ones, so commitChunks may come after)
+    for (Transaction* tx: committed_transactions){
+        tx -> flipAdded();
+    }
+    for (Transaction* tx: aborted_transactions){
+        tx -> flipAdded();
+    }
+
+    // discard segments allocated by aborted transactions
+    for (Transaction* tx : aborted_transactions){
+        for (Segment* sg : tx->allocated){
+            stm->discardSegment(sg);
+        }
+    }
+
+    // update written words, aborted transactions leave nothing to undo
+    commitChunks(waiting);
+    while (pending_commits.load(std::memory_order_acquire) != 0){
+        std::this_thread::yield();
     }
 
     // free segments, delete transactions
     for (Transaction* tx: committed_transactions){
         for (std::size_t start_addr : tx->freed){
             DEBUG_MSG("Freeing segment from committed");
-            stm->freeSegment(start_addr);
+            if (multi_version){
+                deferred_frees.push_back({start_addr, tx -> epoch});
+            }
+            else{
+                stm->freeSegment(start_addr);
+            }
         }
-        delete tx;
+        Transaction::release(tx);
     }
     for (Transaction* tx: aborted_transactions){
-        delete tx;
+        Transaction::release(tx);
     }
     // empty arrays
     committed_transactions.clear();
@@ -2,59 +2,197 @@
 #define BATCHER_H
 
 #include <vector>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <map>
+#include <deque>
 #include <atomic>
+#include <cstdint>
+#include <utility>
+#include "config.hpp"
 
 class Transaction;
 class DualStm;
 
+// Admission and departure are lock-free: transactions only touch `state`, the head of
+// the waiting list and the head of the list of ended transactions.
+// The thread whose departure ends the epoch (the closer) is the only one doing serialized work
 class Batcher{
     private:
-        std::condition_variable cv;
-
+        // wake_state values
+        static constexpr std::uint32_t WAITING = 0;
+        static constexpr std::uint32_t AWAKE = 1;
+        static constexpr std::uint32_t SLEEPING = 2;
+        // asked by the closer to help with the epoch end before being woken up
+        static constexpr std::uint32_t HELP = 3;
+
+        // a thread waiting in enter for the next epoch, lives on that thread's stack
         struct b_thread
         {
-            std::thread::id thread_id;
-            bool awake = false;
+            b_thread* next;
+            bool is_read_only;
+            // the thread must be admitted alone, see enter
+            bool exclusive;
+            // rank of the thread among the ones admitted to the epoch, becomes the tr_num
+            std::size_t tr_num;
+            // epoch the thread is admitted to, set by the closer before waking it up
+            std::size_t epoch = 0;
+            // the thread is alone in the epoch, see Transaction::solo
+            bool solo = false;
+            // the thread's own futex word, see wait() and wake()
+            std::atomic<std::uint32_t> wake_state{WAITING};
         };
-        
-        DualStm* stm;
 
-        std::mutex mutex;
+        DualStm* stm;
 
-        // counter for current epoch number
-        std::size_t counter = 0;
-        // remaining threads in the current epoch
-        std::size_t remaining = 0;
-        // threads waiting to start
-        std::vector<b_thread*> blocked;
+        // unique among all the batchers ever created, unlike their address which a new batcher
+        // may reuse once an old one is destroyed
+        std::uint64_t id;
+
+        EpochPolicy policy;
+
+        // state packs the current epoch number (upper bits), the SOLO flag and the number of
+        // transactions that have not left the epoch yet (lower REMAINING_BITS bits).
+        // SOLO is set for epochs run by one read-write transaction alone, which no read-only
+        // transaction may join
+        static constexpr unsigned REMAINING_BITS = 24;
+        static constexpr std::uint64_t REMAINING_MASK = (std::uint64_t(1) << REMAINING_BITS) - 1;
+        static constexpr std::uint64_t SOLO = std::uint64_t(1) << REMAINING_BITS;
+        static constexpr unsigned EPOCH_SHIFT = REMAINING_BITS + 1;
+
+        // counter for current epoch number starts at 1 so that a word access state
+        // stamped with epoch 0 is never current
+        std::atomic<std::uint64_t> state{std::uint64_t(1) << EPOCH_SHIFT};
+
+        // head of the list of threads waiting for the next epoch, or IDLE when no epoch
+        // is running (nor being closed) and the next transaction can start one by itself
+        std::atomic<b_thread*> blocked;
+        static b_thread idle_sentinel;
+        static constexpr b_thread* IDLE = &idle_sentinel;
+
+        // threads taken from blocked by closers but not admitted yet (policy.max_batch), oldest first
+        std::deque<b_thread*> queued;
+        // threads admitted to the next epoch by the closer
+        std::vector<b_thread*> admitted;
+
+        // threads the current epoch started with
+        std::atomic<std::size_t> started{0};
+        // read-only transactions that joined the current epoch after it started,
+        // at most about `started` so that joiners cannot hold back waiting threads forever
+        // (and within policy.max_batch)
+        std::atomic<std::size_t> joined{0};
+
+        // transactions that left the current epoch, linked through Transaction::next_ended
+        std::atomic<Transaction*> ended{nullptr};
+
+        // in self-commit mode, the thread of each committed transaction with written words waits
+        // in leave for the epoch to be closed (closed holds the low bits of its number), swaps
+        // the words and counts itself out of pending_commits. The closer only opens the next
+        // epoch once pending_commits is back to 0
+        bool self_commit;
+        std::atomic<std::uint32_t> closed{0};
+        std::atomic<std::size_t> pending_commits{0};
+
+        // multi-version mode: read-only transactions do not enter the epochs, they read the snapshot
+        // of the last completed epoch (see beginSnapshot). Segments freed by committed transactions
+        // are only recycled once no snapshot from before they were freed is pinned
+        bool multi_version;
+        // last epoch whose end is over
+        std::atomic<std::size_t> completed{0};
+        // pins[i] is 1 + the epoch of the snapshot of a running read-only transaction, 0 if free
+        static constexpr std::size_t MAX_PINS = 256;
+        std::atomic<std::size_t> pins[MAX_PINS] = {};
+        // start address of freed segments and epoch at the end of which they were freed
+        std::vector<std::pair<std::size_t, std::size_t>> deferred_frees;
 
         std::vector<Transaction*> committed_transactions;
 
         std::vector<Transaction*> aborted_transactions;
 
-        // 1) add segments that were allocated by committed transactions to the STM
-        // 2) update state of words that were accessed in this epoch 
-        //    (for committed/non-committed transactions, on/off the STM)  
+        // range of the words written by one committed transaction, swapped by one thread
+        struct CommitChunk{
+            Transaction* tx;
+            std::size_t begin;
+            std::size_t end;
+        };
+
+        // epochs whose committed transactions wrote fewer words are ended by the closer alone
+        static constexpr std::size_t COMMIT_CHUNK_WORDS = 1024;
+
+        // chunks of the current epoch end, claimed in order through next_chunk
+        // by the closer and the waiting threads it asks for help
+        std::vector<CommitChunk> commit_chunks;
+        std::atomic<std::size_t> next_chunk{0};
+        std::atomic<std::size_t> chunks_done{0};
+        // helpers asked that are not done yet, the closer waits for them all
+        std::atomic<std::size_t> active_helpers{0};
+
+        static std::size_t epochOf(std::uint64_t s){
+            return s >> EPOCH_SHIFT;
+        }
+
+        static std::size_t remainingOf(std::uint64_t s){
+            return s & REMAINING_MASK;
+        }
+
+        // spins on t's wake_state for the configured number of times, then sleeps on it.
+        // Helps with the epoch end whenever asked to in the meantime
+        void wait(b_thread* t);
+
+        // swaps the words of the commit chunks until none is left to claim
+        void helpCommit();
+
+        // swaps the words written by the committed transactions (but the self-committing ones), with the help of
+        // the threads waiting from `waiting` on if there is enough work
+        void commitChunks(b_thread* waiting);
+
+        // wakes up t, making a system call only if it went to sleep
+        static void wake(b_thread* t);
+
+        // read-only transaction tries to join the running epoch
+        Transaction* join();
+
+        // closer: ends the epoch then starts the next one with the waiting threads, if any.
+        // own is the closer's transaction if it commits itself, NULL otherwise
+        void closeEpoch(std::size_t epoch, Transaction* own);
+
+        // closer waits, for at most the gathering window, until policy.min_batch threads wait for
+        // the next epoch. Does not wait if none does: the next one will start an epoch by itself
+        void gather();
+
+        // multi-version mode: read-only transaction pins the snapshot of the last completed epoch,
+        // NULL if no pin is free (it then enters the epochs)
+        Transaction* beginSnapshot();
+
+        // closer recycles the deferred segments that no pinned snapshot can read anymore
+        void recycleFreed();
+
+        // self-committing transaction waits for its epoch to be closed
+        void waitClosed(std::size_t epoch);
+
+        // 1) discard segments that were allocated by aborted transactions
+        //    (the ones allocated by committed transactions are already in the segment table)
+        // 2) swap readable/writable copy of the words written by committed transactions
+        //    (the access state of every word accessed in this epoch becomes stale by itself),
+        //    with the help of the threads in waiting when there is enough to swap
         // 3) free (on STM) segments that were freed by committed transactions
-        // 4) delete all transactions
-        void onEpochEnd();
+        // 4) release all transactions to their thread's pool
+        void onEpochEnd(b_thread* waiting);
 
     public:
-        Batcher(DualStm* i_dual_stm):stm(i_dual_stm){};
+        Batcher(DualStm* i_dual_stm, EpochPolicy const& i_policy, bool i_multi_version);
 
         ~Batcher();
 
-        // transaction begins
-        Transaction* enter(bool is_read_only);
+        // transaction begins, in the current epoch if there is none running or if it is
+        // read-only (it only reads the readable copies, which are not changed until
+        // the epoch ends), otherwise it waits for the next one.
+        // An exclusive transaction (read-write) is admitted to an epoch of its own, which it runs solo.
+        // In multi-version mode, read-only transactions read a snapshot instead, outside of the epochs
+        Transaction* enter(bool is_read_only, bool exclusive = false);
 
-        // transaction ends
+        // transaction ends. In self-commit mode, returns once a committed transaction
+        // has swapped its written words, at the end of its epoch
         void leave(Transaction * tx);
 
 };
 
 
-#endif
\ No newline at end of file
+#endif
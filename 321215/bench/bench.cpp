@@ -0,0 +1,335 @@
+// Micro-benchmarks of the dual-versioned STM, linked against the library built in
+// the parent directory.
+// Usage: bench [write|enterleave|counter|scan|alloc]
+//   write: single thread, read-write transactions writing ranges of words with tm_write
+//   enterleave: empty transactions begun and ended by an increasing number of threads,
+//               measures the rate at which the batcher admits and retires them
+//   counter: threads incrementing one shared counter, with tm_read + tm_write, tm_update or tm_add,
+//            reports the abort rate and checks the final value of the counter (and the values returned by tm_update)
+//   scan: single thread, read-only transactions summing an array of words read with tm_read or tm_read_view,
+//         and first scans of freshly allocated segments
+//   alloc: time of tm_create, tm_alloc and tm_free for increasing sizes, which should not depend on the size
+//          (the memory of the segments is only materialized, zeroed, when first touched)
+
+#include <tm.hpp>
+#include <tm_ext.hpp>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// nanoseconds elapsed since start
+static double elapsedNs(Clock::time_point start){
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+
+// each transaction writes num_ranges ranges of words_per_write words,
+// reports the time per tm_write and the write throughput
+static void benchWrite(std::size_t words_per_write){
+    const std::size_t alignment = sizeof(void*);
+    const std::size_t num_ranges = 16;
+    const std::size_t num_tx = 20000;
+    std::size_t range_size = words_per_write * alignment;
+    shared_t shared = tm_create(num_ranges * range_size, alignment);
+    char* start = static_cast<char*>(tm_start(shared));
+    std::vector<char> source(range_size, 1);
+
+    auto begin = Clock::now();
+    for (std::size_t i = 0; i < num_tx; i++){
+        tx_t tx = tm_begin(shared, false);
+        for (std::size_t r = 0; r < num_ranges; r++){
+            if (!tm_write(shared, tx, source.data(), range_size, start + r * range_size)){
+                std::cerr << "unexpected abort" << std::endl;
+                return;
+            }
+        }
+        tm_end(shared, tx);
+    }
+    double ns = elapsedNs(begin);
+    tm_destroy(shared);
+
+    double num_writes = static_cast<double>(num_tx * num_ranges);
+    std::cout << "write " << words_per_write << " word(s): " << ns / num_writes << " ns/tm_write, "
+              << (num_writes * range_size) / ns * 1e3 << " MB/s" << std::endl;
+}
+
+
+// each of num_threads threads begins and ends num_tx empty transactions,
+// one in read_only_every of them read-only (none if 0), the others read-write
+static void benchEnterLeave(std::size_t num_threads, std::size_t read_only_every){
+    const std::size_t num_tx = 20000;
+    shared_t shared = tm_create(sizeof(void*), sizeof(void*));
+    std::vector<std::thread> threads;
+
+    auto begin = Clock::now();
+    for (std::size_t t = 0; t < num_threads; t++){
+        threads.emplace_back([shared, read_only_every](){
+            for (std::size_t i = 0; i < num_tx; i++){
+                tx_t tx = tm_begin(shared, read_only_every != 0 && i % read_only_every == 0);
+                tm_end(shared, tx);
+            }
+        });
+    }
+    for (auto& thread : threads){
+        thread.join();
+    }
+    double ns = elapsedNs(begin);
+    tm_destroy(shared);
+
+    double total_tx = static_cast<double>(num_threads * num_tx);
+    std::cout << "enterleave " << num_threads << " thread(s), "
+              << (read_only_every != 0 ? "1/" + std::to_string(read_only_every) : std::string("none")) << " read-only: "
+              << total_tx / ns * 1e3 << " Mtx/s, " << ns / total_tx << " ns/tx" << std::endl;
+}
+
+
+// each of num_threads threads commits num_tx transactions incrementing the counter,
+// retrying the aborted ones
+static void benchCounter(std::size_t num_threads, std::string const& operation){
+    const std::size_t num_tx = 20000;
+    shared_t shared = tm_create(sizeof(std::uint64_t), sizeof(std::uint64_t));
+    void* counter = tm_start(shared);
+    std::atomic<std::size_t> aborts{0};
+    // sum of the old values returned by the committed tm_update calls
+    std::atomic<std::uint64_t> old_sum{0};
+    std::vector<std::thread> threads;
+
+    auto begin = Clock::now();
+    for (std::size_t t = 0; t < num_threads; t++){
+        threads.emplace_back([shared, counter, &operation, &aborts, &old_sum](){
+            for (std::size_t i = 0; i < num_tx; i++){
+                while (true){
+                    tx_t tx = tm_begin(shared, false);
+                    bool can_continue;
+                    std::uint64_t old = 0;
+                    if (operation == "tm_add"){
+                        can_continue = tm_add(shared, tx, counter, 1);
+                    }
+                    else if (operation == "tm_update"){
+                        can_continue = tm_update(shared, tx, counter, tm_update_add, 1, 0, &old);
+                    }
+                    else{
+                        std::uint64_t value;
+                        can_continue = tm_read(shared, tx, counter, sizeof(value), &value);
+                        value++;
+                        can_continue = can_continue && tm_write(shared, tx, &value, sizeof(value), counter);
+                    }
+                    if (can_continue && tm_end(shared, tx)){
+                        old_sum.fetch_add(old, std::memory_order_relaxed);
+                        break;
+                    }
+                    aborts.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads){
+        thread.join();
+    }
+    double ns = elapsedNs(begin);
+
+    // every transaction committed exactly one increment
+    std::uint64_t final_value = 0;
+    tx_t tx = tm_begin(shared, true);
+    tm_read(shared, tx, counter, sizeof(final_value), &final_value);
+    tm_end(shared, tx);
+    assert(final_value == num_threads * num_tx);
+    // and tm_update returned each of the values 0 .. final_value - 1 once
+    assert(operation != "tm_update" || old_sum.load() == final_value * (final_value - 1) / 2);
+    (void) final_value;
+    tm_destroy(shared);
+
+    double total_tx = static_cast<double>(num_threads * num_tx);
+    std::cout << "counter " << operation << " " << num_threads << " thread(s): "
+              << total_tx / ns * 1e3 << " Mtx/s, " << aborts.load() / total_tx << " aborts/commit" << std::endl;
+}
+
+
+// first scan of a freshly allocated segment of num_words words by a read-only transaction with tm_read:
+// only the copy of the words that is readable is touched, the other one is never materialized
+static void benchScanFresh(std::size_t num_words){
+    const std::size_t num_rounds = 20;
+    std::size_t size = num_words * sizeof(std::uint64_t);
+    shared_t shared = tm_create(sizeof(std::uint64_t), sizeof(std::uint64_t));
+    std::vector<std::uint64_t> buffer(num_words);
+    std::uint64_t sum = 0;
+    double ns = 0;
+    for (std::size_t i = 0; i < num_rounds; i++){
+        void* segment;
+        tx_t tx = tm_begin(shared, false);
+        Alloc result = tm_alloc(shared, tx, size, &segment);
+        tm_end(shared, tx);
+        if (result != Alloc::success){
+            std::cerr << "tm_alloc failed for " << size << " bytes" << std::endl;
+            tm_destroy(shared);
+            return;
+        }
+
+        auto begin = Clock::now();
+        tx = tm_begin(shared, true);
+        tm_read(shared, tx, segment, size, buffer.data());
+        tm_end(shared, tx);
+        ns += elapsedNs(begin);
+        for (std::size_t w = 0; w < num_words; w++){
+            sum += buffer[w];
+        }
+
+        tx = tm_begin(shared, false);
+        tm_free(shared, tx, segment);
+        tm_end(shared, tx);
+    }
+    tm_destroy(shared);
+
+    std::cout << "scan fresh segment " << num_words << " word(s): " << ns / num_rounds / 1e3 << " us/tx, "
+              << (static_cast<double>(size) * num_rounds) / ns * 1e3 << " MB/s" << (sum != 0 ? " (nonzero sum)" : "") << std::endl;
+}
+
+
+// one transaction applying each tm_update operation in turn, checks the old values it returns
+// and the value left in the word
+static void checkUpdate(){
+    shared_t shared = tm_create(sizeof(std::uint64_t), sizeof(std::uint64_t));
+    void* word = tm_start(shared);
+    std::uint64_t old_add = 1, old_exchange = 1, old_cas_hit = 1, old_cas_miss = 1, value = 1;
+    tx_t tx = tm_begin(shared, false);
+    bool committed = tm_update(shared, tx, word, tm_update_add, 5, 0, &old_add)
+        && tm_update(shared, tx, word, tm_update_exchange, 7, 0, &old_exchange)
+        && tm_update(shared, tx, word, tm_update_cas, 9, 7, &old_cas_hit)
+        && tm_update(shared, tx, word, tm_update_cas, 11, 7, &old_cas_miss)
+        && tm_end(shared, tx);
+    tx = tm_begin(shared, true);
+    tm_read(shared, tx, word, sizeof(value), &value);
+    tm_end(shared, tx);
+    tm_destroy(shared);
+
+    assert(committed);
+    assert(old_add == 0 && old_exchange == 5 && old_cas_hit == 7 && old_cas_miss == 9);
+    assert(value == 9);
+    (void) committed;
+    (void) value;
+}
+
+
+// each read-only transaction sums the num_words words of the region, copied by tm_read into a private
+// buffer or read in place through tm_read_view
+static void benchScan(std::size_t num_words, bool use_view){
+    const std::size_t num_tx = 2000;
+    shared_t shared = tm_create(num_words * sizeof(std::uint64_t), sizeof(std::uint64_t));
+    void* start = tm_start(shared);
+    std::vector<std::uint64_t> buffer(num_words);
+    std::uint64_t sum = 0;
+
+    auto begin = Clock::now();
+    for (std::size_t i = 0; i < num_tx; i++){
+        tx_t tx = tm_begin(shared, true);
+        std::uint64_t const* words = buffer.data();
+        if (use_view){
+            words = static_cast<std::uint64_t const*>(tm_read_view(shared, tx, start, num_words * sizeof(std::uint64_t)));
+        }
+        else{
+            tm_read(shared, tx, start, num_words * sizeof(std::uint64_t), buffer.data());
+        }
+        for (std::size_t w = 0; w < num_words; w++){
+            sum += words[w];
+        }
+        tm_end(shared, tx);
+    }
+    double ns = elapsedNs(begin);
+    tm_destroy(shared);
+
+    std::cout << "scan " << (use_view ? "tm_read_view" : "tm_read") << " " << num_words << " word(s): "
+              << ns / num_tx << " ns/tx" << (sum != 0 ? " (nonzero sum)" : "") << std::endl;
+}
+
+
+// average time of num_rounds tm_create of a region of size bytes, and of tm_alloc and tm_free
+// of a segment of size bytes in it
+static void benchAlloc(std::size_t size){
+    const std::size_t alignment = sizeof(void*);
+    const std::size_t num_rounds = 20;
+    double create_ns = 0;
+    double alloc_ns = 0;
+    double free_ns = 0;
+    for (std::size_t i = 0; i < num_rounds; i++){
+        auto begin = Clock::now();
+        shared_t shared = tm_create(size, alignment);
+        create_ns += elapsedNs(begin);
+        if (shared == invalid_shared){
+            std::cerr << "tm_create failed for " << size << " bytes" << std::endl;
+            return;
+        }
+
+        void* segment;
+        begin = Clock::now();
+        tx_t tx = tm_begin(shared, false);
+        Alloc result = tm_alloc(shared, tx, size, &segment);
+        tm_end(shared, tx);
+        alloc_ns += elapsedNs(begin);
+        if (result != Alloc::success){
+            std::cerr << "tm_alloc failed for " << size << " bytes" << std::endl;
+            tm_destroy(shared);
+            return;
+        }
+
+        begin = Clock::now();
+        tx = tm_begin(shared, false);
+        tm_free(shared, tx, segment);
+        tm_end(shared, tx);
+        free_ns += elapsedNs(begin);
+        tm_destroy(shared);
+    }
+    std::cout << "alloc " << size << " bytes: tm_create " << create_ns / num_rounds / 1e3 << " us, tm_alloc "
+              << alloc_ns / num_rounds / 1e3 << " us, tm_free " << free_ns / num_rounds / 1e3 << " us" << std::endl;
+}
+
+
+int main(int argc, char** argv){
+    std::string mode = argc > 1 ? argv[1] : "write";
+    if (mode == "write"){
+        for (std::size_t words : {1, 4, 16, 64}){
+            benchWrite(words);
+        }
+    }
+    else if (mode == "enterleave"){
+        for (std::size_t read_only_every : {0, 2}){
+            for (std::size_t threads : {1, 2, 4, 8, 16, 32}){
+                benchEnterLeave(threads, read_only_every);
+            }
+        }
+    }
+    else if (mode == "counter"){
+        checkUpdate();
+        for (std::string operation : {"read+write", "tm_update", "tm_add"}){
+            for (std::size_t threads : {1, 2, 4, 8, 16}){
+                benchCounter(threads, operation);
+            }
+        }
+    }
+    else if (mode == "scan"){
+        for (bool use_view : {false, true}){
+            for (std::size_t words : {64, 1024, 16384}){
+                benchScan(words, use_view);
+            }
+        }
+        for (std::size_t words : {std::size_t(1) << 14, std::size_t(1) << 20, std::size_t(1) << 23}){
+            benchScanFresh(words);
+        }
+    }
+    else if (mode == "alloc"){
+        for (std::size_t size : {std::size_t(1) << 12, std::size_t(1) << 20, std::size_t(1) << 26, std::size_t(1) << 30}){
+            benchAlloc(size);
+        }
+    }
+    else{
+        std::cerr << "Usage: " << argv[0] << " [write|enterleave|counter|scan|alloc]" << std::endl;
+        return 1;
+    }
+    return 0;
+}
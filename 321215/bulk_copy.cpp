@@ -0,0 +1,74 @@
+#include "bulk_copy.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BULK_COPY_X86
+#include <immintrin.h>
+#endif
+
+
+static void gatherWords8Scalar(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors, std::size_t num_words){
+    char* out_buffer = static_cast<char*>(target);
+    for (std::size_t i = 0; i < num_words; i++){
+        char const* source = (selectors[i] & WordControl::COPY_B_READABLE) ? copy_b : copy_a;
+        memcpy(out_buffer + 8 * i, source + 8 * i, 8);
+    }
+}
+
+
+#ifdef BULK_COPY_X86
+
+// two words per iteration, the selector mask is the sign bit replicated over each 64-bit lane
+__attribute__((target("sse2")))
+static void gatherWords8Sse2(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors, std::size_t num_words){
+    char* out_buffer = static_cast<char*>(target);
+    std::size_t i = 0;
+    for (; i + 2 <= num_words; i += 2){
+        __m128i sel = _mm_loadu_si128(reinterpret_cast<__m128i const*>(selectors + i));
+        __m128i mask = _mm_shuffle_epi32(_mm_srai_epi32(sel, 31), _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(copy_a + 8 * i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(copy_b + 8 * i));
+        __m128i res = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out_buffer + 8 * i), res);
+    }
+    gatherWords8Scalar(out_buffer + 8 * i, copy_a + 8 * i, copy_b + 8 * i, selectors + i, num_words - i);
+}
+
+// four words per iteration, blendv picks the lane of copy_b when the sign bit of the selector is set
+__attribute__((target("avx2")))
+static void gatherWords8Avx2(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors, std::size_t num_words){
+    char* out_buffer = static_cast<char*>(target);
+    std::size_t i = 0;
+    for (; i + 4 <= num_words; i += 4){
+        __m256d sel = _mm256_castsi256_pd(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(selectors + i)));
+        __m256d a = _mm256_castsi256_pd(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(copy_a + 8 * i)));
+        __m256d b = _mm256_castsi256_pd(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(copy_b + 8 * i)));
+        __m256i res = _mm256_castpd_si256(_mm256_blendv_pd(a, b, sel));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out_buffer + 8 * i), res);
+    }
+    gatherWords8Scalar(out_buffer + 8 * i, copy_a + 8 * i, copy_b + 8 * i, selectors + i, num_words - i);
+}
+
+#endif
+
+
+using GatherFn = void (*)(void*, char const*, char const*, std::uint64_t const*, std::size_t);
+
+// picks the widest implementation supported by the CPU, once
+static GatherFn selectGatherWords8(){
+#ifdef BULK_COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        return gatherWords8Avx2;
+    }
+    if (__builtin_cpu_supports("sse2")){
+        return gatherWords8Sse2;
+    }
+#endif
+    return gatherWords8Scalar;
+}
+
+
+void gatherWords8(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors, std::size_t num_words){
+    static GatherFn const gather_fn = selectGatherWords8();
+    gather_fn(target, copy_a, copy_b, selectors, num_words);
+}
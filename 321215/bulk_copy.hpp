@@ -0,0 +1,43 @@
+#ifndef BULK_COPY_H
+#define BULK_COPY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+#include "word.hpp"
+
+// number of words whose copy is selected and gathered at once by Segment::read
+#define BULK_CHUNK_WORDS 64
+
+// gathers num_words 8-byte words into target, word i is taken from copy_b[i] if
+// the most significant bit of selectors[i] is set, from copy_a[i] otherwise
+// (the selectors have the same layout as the control word, see WordControl::COPY_B_READABLE).
+// Uses AVX2 or SSE2 when the CPU supports them, a scalar loop otherwise
+void gatherWords8(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors, std::size_t num_words);
+
+
+// gathers num_words words of size W (W = 0 for the runtime alignment) into target,
+// word i is taken from copy_b if the most significant bit of selectors[i] is set, from copy_a otherwise
+template <std::size_t W>
+struct BulkCopy{
+    static void gather(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors,
+            std::size_t num_words, std::size_t alignment){
+        std::size_t word_size = W != 0 ? W : alignment;
+        char* out_buffer = static_cast<char*>(target);
+        for (std::size_t i = 0; i < num_words; i++){
+            std::size_t offset = i * word_size;
+            char const* source = (selectors[i] & WordControl::COPY_B_READABLE) ? copy_b : copy_a;
+            WordCopy<W>::copy(out_buffer + offset, source + offset, alignment);
+        }
+    }
+};
+
+template <>
+struct BulkCopy<8>{
+    static void gather(void* target, char const* copy_a, char const* copy_b, std::uint64_t const* selectors,
+            std::size_t num_words, std::size_t){
+        gatherWords8(target, copy_a, copy_b, selectors, num_words);
+    }
+};
+
+#endif
@@ -0,0 +1,35 @@
+#include "config.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+// value of environment variable name parsed as an unsigned integer, default_value if unset
+static std::size_t envSize(char const* name, std::size_t default_value){
+    char const* value = std::getenv(name);
+    if (value == NULL || *value == '\0'){
+        return default_value;
+    }
+    return std::strtoull(value, NULL, 0);
+}
+
+static Config loadConfig(){
+    Config config;
+    config.arena_size = envSize("DUALSTM_ARENA_SIZE", config.arena_size);
+    config.huge_pages = envSize("DUALSTM_HUGE_PAGES", config.huge_pages) != 0;
+    config.self_commit = envSize("DUALSTM_SELF_COMMIT", config.self_commit) != 0;
+    config.epoch_policy.min_batch = envSize("DUALSTM_EPOCH_MIN_BATCH", config.epoch_policy.min_batch);
+    config.epoch_policy.gathering_window_us = envSize("DUALSTM_EPOCH_WINDOW_US", config.epoch_policy.gathering_window_us);
+    config.epoch_policy.max_batch = envSize("DUALSTM_EPOCH_MAX_BATCH", config.epoch_policy.max_batch);
+    config.versions = envSize("DUALSTM_VERSIONS", config.versions);
+    if (config.versions == 1){
+        config.versions = 2;
+    }
+    config.wait_spins = envSize("DUALSTM_WAIT_SPINS", std::thread::hardware_concurrency() > 1 ? 4000 : 0);
+    return config;
+}
+
+// configuration of the process, read from the environment on first use
+Config const& Config::get(){
+    static Config const config = loadConfig();
+    return config;
+}
@@ -0,0 +1,49 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstddef>
+
+// how the batcher forms epochs. The defaults are latency-first: the next epoch starts as soon
+// as the previous one ends, with every thread waiting for it
+struct EpochPolicy{
+    // if fewer threads (but at least one) wait for the next epoch when the previous one ends,
+    // the batcher gathers more of them, for at most gathering_window_us microseconds
+    std::size_t min_batch = 1;
+    std::size_t gathering_window_us = 0;
+
+    // transactions admitted to one epoch, read-only joiners included (0 for no limit).
+    // The threads left over wait for the next epoch, first in line
+    std::size_t max_batch = 0;
+};
+
+// tuning knobs of the STM, read once from the environment
+//   DUALSTM_ARENA_SIZE  : bytes of virtual address space reserved per shared memory region
+//   DUALSTM_HUGE_PAGES  : 1 to back segments of at least HUGE_PAGE_SIZE bytes with transparent huge pages
+//   DUALSTM_WAIT_SPINS  : times a thread waiting for the next epoch checks for its wakeup before it sleeps
+//   DUALSTM_SELF_COMMIT : 1 for read-write transactions to swap their own written words when their epoch ends
+//   DUALSTM_EPOCH_MIN_BATCH, DUALSTM_EPOCH_WINDOW_US, DUALSTM_EPOCH_MAX_BATCH : default EpochPolicy
+//   DUALSTM_VERSIONS    : committed versions kept per word for read-only snapshots, 0 (default) to disable
+struct Config{
+    static constexpr std::size_t HUGE_PAGE_SIZE = std::size_t(2) << 20;
+
+    std::size_t arena_size = std::size_t(64) << 30;
+
+    bool huge_pages = false;
+
+    // no spinning by default on a single hardware thread, the closer cannot run while a waiter spins
+    std::size_t wait_spins;
+
+    bool self_commit = false;
+
+    // policy of the shared memory regions that do not set one at creation
+    EpochPolicy epoch_policy;
+
+    // multi-version mode if not 0 (then at least 2: the first version of a word and the
+    // value it is first committed with)
+    std::size_t versions = 0;
+
+    // configuration of the process, read from the environment on first use
+    static Config const& get();
+};
+
+#endif
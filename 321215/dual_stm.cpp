@@ -5,82 +5,120 @@
 #include <assert.h>
 #include <string.h>
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
 #include "debug.hpp"
+#include "config.hpp"
 
 // Create (i.e. allocate + init) a new shared memory region, with one first allocated segment of
 // the requested size and alignment.
-// Initializes also the batcher
-DualStm::DualStm(std::size_t i_size, std::size_t i_alignment):
-alignment(i_alignment), size_first_segment(i_size){
-    std::size_t start_address = std::atomic_fetch_add(&end_address, i_size);
-    std::size_t end_address = start_address + i_size;
+// Initializes also the batcher, which forms epochs following policy
+DualStm::DualStm(std::size_t i_size, std::size_t i_alignment, EpochPolicy const& policy):
+arena(Config::get().arena_size, Segment::storageSize(i_alignment, i_size / i_alignment, Config::get().versions)),
+alignment(i_alignment), size_first_segment(i_size), num_versions(Config::get().versions){
+    // calloc: the pages of the table are zeroed lazily by the kernel
+    segment_table = static_cast<std::atomic<Segment*>*>(std::calloc(MAX_SEGMENTS, sizeof(std::atomic<Segment*>)));
+    std::size_t index = next_segment_index.fetch_add(1);
+    std::size_t start_address = index << SEGMENT_INDEX_SHIFT;
     std::size_t num_words = i_size / alignment;
-    Segment* segment = new Segment(alignment, num_words, start_address);
-    segments[start_address] = segment;
-    addresses[end_address] = start_address;
-    batcher = new Batcher(this);
+    if (arena.isReserved()){
+        Segment* segment = Segment::create(arena, alignment, num_words, start_address, num_versions);
+        segment_table[index].store(segment, std::memory_order_release);
+    }
+    batcher = new Batcher(this, policy, num_versions != 0);
 }
 
-// deallocate all segments, delete Batcher
-DualStm::~DualStm(){
-    for (auto it = segments.begin(); it != segments.end(); it++){
-        delete it->second;
+// Create a new shared memory region with the engine specialized for the given alignment
+// (8, 16, 32 or 64 bytes), or the generic engine for any other alignment
+DualStm* DualStm::create(std::size_t size, std::size_t alignment, EpochPolicy const& policy){
+    DualStm* stm;
+    switch (alignment){
+        case 8:
+            stm = new DualStmEngine<8>(size, alignment, policy);
+            break;
+        case 16:
+            stm = new DualStmEngine<16>(size, alignment, policy);
+            break;
+        case 32:
+            stm = new DualStmEngine<32>(size, alignment, policy);
+            break;
+        case 64:
+            stm = new DualStmEngine<64>(size, alignment, policy);
+            break;
+        default:
+            stm = new DualStmEngine<0>(size, alignment, policy);
+            break;
+    }
+    // address space or first segment could not be reserved
+    if (stm -> findSegment(reinterpret_cast<std::size_t>(stm -> getHead())) == NULL){
+        delete stm;
+        return NULL;
     }
+    return stm;
+}
+
+// deallocate all segments (unmapped with the arena), delete Batcher
+DualStm::~DualStm(){
+    std::free(segment_table);
     delete batcher;
 }
 
 // Get a pointer in shared memory to the first allocated segment of the shared memory region
 void* DualStm::getHead(){
-    std::size_t first_address = 1;
+    std::size_t first_address = std::size_t(1) << SEGMENT_INDEX_SHIFT;
     return reinterpret_cast<void*>(first_address);
 }
 
 
 
-// adds segment to segments, invoked by the batcher at the end of one epoch (sequentially)
-// to add newly allocated segments by the committed transactions
-void DualStm::addSegment(std::size_t start_addr, Segment* segment){
-    segments[start_addr] = segment;
-    std::size_t seg_end_addr = start_addr + (segment->num_words * segment->alignment);
-    addresses[seg_end_addr] = start_addr;
+// takes a segment index, recycled if possible, MAX_SEGMENTS if none is left
+std::size_t DualStm::takeSegmentIndex(){
+    {
+        std::unique_lock<std::mutex> lock(index_mutex);
+        if (!free_indices.empty()){
+            std::size_t index = free_indices.back();
+            free_indices.pop_back();
+            return index;
+        }
+    }
+    std::size_t index = next_segment_index.fetch_add(1);
+    return index < MAX_SEGMENTS ? index : MAX_SEGMENTS;
+}
+
+
+// removes segment from the segment table and recycles its index and its storage
+void DualStm::retireSegment(std::size_t index, Segment* segment){
+    segment_table[index].store(NULL, std::memory_order_release);
+    Segment::destroy(arena, segment);
+    std::unique_lock<std::mutex> lock(index_mutex);
+    free_indices.push_back(index);
+}
+
+
+// removes from the segment table and recycles a segment allocated by an aborted transaction,
+// invoked by the batcher at the end of one epoch
+void DualStm::discardSegment(Segment* segment){
+    retireSegment(segment->start_address >> SEGMENT_INDEX_SHIFT, segment);
 }
 
 
-// deletes segment with address at start address, if not already deleted.
+// recycles segment with address at start address, if not already freed.
 // invoked by the batcher at the end of one epoch
 void DualStm::freeSegment(size_t start_address){
-    if (segments.count(start_address) == 1){
-        Segment* sg = segments[start_address];
-        std::size_t seg_end_addr = start_address + (sg->alignment * sg->num_words);
-        addresses.erase(seg_end_addr);
-        delete sg;
-        segments.erase(start_address);
-    }
-}
-
-
-// returns segment with start_address <= address < end_address, looks in segment allocated 
-// by the transaction and the ones already in the STM
-Segment* DualStm::findSegment(std::size_t address, Transaction* tx){
-    Segment* sg = tx->findSegment(address);
-    // not allocated by the current transaction, so it should be allocated in STM
-    if (sg == NULL){
-        auto it = addresses.upper_bound(address);
-        std::size_t start_addr = it -> second;
-        if (address < start_addr){  // segment not found, it has been freed by another transaction
-            //std::cout << "Looking for address: " << address << ".But found segment that starts at: " << start_addr << std::endl << std::flush;
-            return NULL;
-        }
-        //assert((address >= start_addr) == true);
-        sg = segments[start_addr];
+    std::size_t index = start_address >> SEGMENT_INDEX_SHIFT;
+    if (index >= MAX_SEGMENTS){
+        return;
+    }
+    Segment* sg = segment_table[index].load(std::memory_order_acquire);
+    if (sg != NULL){
+        retireSegment(index, sg);
     }
-    return sg;
 }
 
 // Begin a new transaction on the given shared memory region. Adds transaction to the
-// batcher
-Transaction* DualStm::begin(bool is_read_only){
-    Transaction* tx = batcher -> enter(is_read_only);
+// batcher, in an epoch of its own if exclusive
+Transaction* DualStm::begin(bool is_read_only, bool exclusive){
+    Transaction* tx = batcher -> enter(is_read_only, exclusive);
     return tx;
 }
 
@@ -90,14 +128,16 @@ Transaction* DualStm::begin(bool is_read_only){
 // target is output buffer that has to be written
 // size: length to copy in bytes
 // Returns: true: the transaction can continue, false: the transaction has aborted
-bool DualStm::read(Transaction* tx, void const * source, std::size_t size, void* target){
+template <std::size_t W>
+bool DualStmEngine<W>::read(Transaction* tx, void const * source, std::size_t size, void* target){
+    std::size_t word_size = W != 0 ? W : alignment;
     std::size_t addr = reinterpret_cast<std::size_t>(source);
-    Segment* sg = findSegment(addr, tx);
+    Segment* sg = findSegment(addr);
     bool can_continue;
     if (sg != NULL){    
-        std::size_t start_word_idx = (addr - sg->start_address) / alignment;
-        std::size_t num_words = size / alignment;
-        can_continue = sg->read(start_word_idx, num_words, tx, target);
+        std::size_t start_word_idx = (addr - sg->start_address) / word_size;
+        std::size_t num_words = size / word_size;
+        can_continue = sg->template read<W>(start_word_idx, num_words, tx, target);
     }else{ //trying to access freed segment
         std::cout << "transaction " << tx->tr_num << " from epoch " << tx->epoch << " trying to read address " << addr << " but segment was freed, aborting.\n";
         assert(false);
@@ -115,14 +155,16 @@ bool DualStm::read(Transaction* tx, void const * source, std::size_t size, void*
 // size: length to copy in bytes
 // target: start address
 // Returns: true: the transaction can continue, false: the transaction has aborted
-bool DualStm::write(Transaction* tx, void const* source, std::size_t size, void * target){
+template <std::size_t W>
+bool DualStmEngine<W>::write(Transaction* tx, void const* source, std::size_t size, void * target){
+    std::size_t word_size = W != 0 ? W : alignment;
     std::size_t addr = reinterpret_cast<std::size_t>(target);
-    Segment* sg = findSegment(addr, tx);
+    Segment* sg = findSegment(addr);
     bool can_continue;
     if (sg != NULL){
-        std::size_t start_word_idx = (addr - sg->start_address) / alignment;
-        std::size_t num_words = size / alignment;
-        can_continue = sg -> write(start_word_idx, num_words, tx, source);
+        std::size_t start_word_idx = (addr - sg->start_address) / word_size;
+        std::size_t num_words = size / word_size;
+        can_continue = sg -> template write<W>(start_word_idx, num_words, tx, source);
     }
     else{   //trying to access freed segment
         std::cout << "transaction " << tx->tr_num << " from epoch " << tx->epoch << " trying to write address " << addr << " but segment was freed, aborting.\n";
@@ -135,17 +177,158 @@ bool DualStm::write(Transaction* tx, void const* source, std::size_t size, void
 }
 
 
-// allocates new segment, increments atomically end_address and adds the segment to the allocated 
-// segments in the transaction. If at the end the transaction is committed, the allocated segments are
-// added to the STM by the batcher at the end of an epoch 
-bool DualStm::alloc(Transaction* tx, std::size_t size, void ** target){
-    std::size_t start_address = std::atomic_fetch_add(&end_address, size);
+bool DualStm::add(Transaction* tx, void* target, std::int64_t delta){
+    if (alignment != sizeof(std::uint64_t)){
+        std::uint64_t old;
+        return update(tx, target, UpdateOp::ADD, static_cast<std::uint64_t>(delta), 0, &old);
+    }
+    std::size_t addr = reinterpret_cast<std::size_t>(target);
+    Segment* sg = findSegment(addr);
+    bool can_continue;
+    if (sg != NULL){
+        can_continue = sg -> add((addr - sg->start_address) / sizeof(std::uint64_t), tx, static_cast<std::uint64_t>(delta));
+    }
+    else{   //trying to access freed segment
+        std::cout << "transaction " << tx->tr_num << " from epoch " << tx->epoch << " trying to add to address " << addr << " but segment was freed, aborting.\n";
+        assert(false);
+    }
+    if(!can_continue){
+        batcher -> leave(tx);
+    }
+    return can_continue;
+}
+
+
+// with words of 8 bytes or more the 64-bit integer is at the start of one word, updated in place.
+// Smaller words are read and written through a buffer on the stack
+template <std::size_t W>
+bool DualStmEngine<W>::update(Transaction* tx, void* target, UpdateOp op, std::uint64_t operand, std::uint64_t expected,
+        std::uint64_t* old){
+    std::size_t word_size = W != 0 ? W : alignment;
+    if (word_size < sizeof(std::uint64_t)){
+        std::uint64_t value;
+        if (!read(tx, target, sizeof(value), &value)){
+            return false;
+        }
+        *old = value;
+        value = applyUpdate(op, value, operand, expected);
+        return write(tx, &value, sizeof(value), target);
+    }
+    std::size_t addr = reinterpret_cast<std::size_t>(target);
+    Segment* sg = findSegment(addr);
+    bool can_continue;
+    if (sg != NULL){
+        can_continue = sg -> update((addr - sg->start_address) / word_size, tx, op, operand, expected, old);
+    }
+    else{   //trying to access freed segment
+        std::cout << "transaction " << tx->tr_num << " from epoch " << tx->epoch << " trying to update address " << addr << " but segment was freed, aborting.\n";
+        assert(false);
+    }
+    if(!can_continue){
+        batcher -> leave(tx);
+    }
+    return can_continue;
+}
+
+
+// ranges are usually already grouped (e.g. all in one segment), otherwise they are visited through a
+// per-thread array of their indices, stable-sorted by segment index so that overlapping writes keep their order
+template <std::size_t W>
+bool DualStmEngine<W>::transferv(Transaction* tx, tm_iovec const* ranges, std::size_t count, bool writing){
+    static thread_local std::vector<std::size_t> order;
+    std::size_t word_size = W != 0 ? W : alignment;
+    auto segmentIndex = [ranges](std::size_t k){
+        return reinterpret_cast<std::size_t>(ranges[k].shared) >> SEGMENT_INDEX_SHIFT;
+    };
+    bool grouped = true;
+    for (std::size_t k = 1; k < count && grouped; k++){
+        grouped = segmentIndex(k - 1) <= segmentIndex(k);
+    }
+    if (!grouped){
+        order.resize(count);
+        for (std::size_t k = 0; k < count; k++){
+            order[k] = k;
+        }
+        std::stable_sort(order.begin(), order.end(), [&segmentIndex](std::size_t a, std::size_t b){
+            return segmentIndex(a) < segmentIndex(b);
+        });
+    }
+    Segment* sg = NULL;
+    for (std::size_t i = 0; i < count; i++){
+        tm_iovec const& range = ranges[grouped ? i : order[i]];
+        std::size_t addr = reinterpret_cast<std::size_t>(range.shared);
+        if (sg == NULL || (addr >> SEGMENT_INDEX_SHIFT) != (sg->start_address >> SEGMENT_INDEX_SHIFT)){
+            sg = findSegment(addr);
+            if (sg == NULL){    //trying to access freed segment
+                std::cout << "transaction " << tx->tr_num << " from epoch " << tx->epoch << " trying to access address " << addr << " but segment was freed, aborting.\n";
+                assert(false);
+            }
+        }
+        std::size_t start_word_idx = (addr - sg->start_address) / word_size;
+        std::size_t num_words = range.size / word_size;
+        bool can_continue = writing ? sg -> template write<W>(start_word_idx, num_words, tx, range.priv)
+                                    : sg -> template read<W>(start_word_idx, num_words, tx, range.priv);
+        if (!can_continue){
+            batcher -> leave(tx);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// snapshot transactions read committed versions, and the copies of the words accessed by read-write
+// transactions may be swapped (solo) or written within the transaction: they get a private copy
+template <std::size_t W>
+void const* DualStmEngine<W>::readView(Transaction* tx, void const* source, std::size_t size){
+    std::size_t word_size = W != 0 ? W : alignment;
+    if (tx -> is_read_only && !tx -> snapshot){
+        std::size_t addr = reinterpret_cast<std::size_t>(source);
+        Segment* sg = findSegment(addr);
+        if (sg != NULL){
+            char const* view = sg -> readView((addr - sg->start_address) / word_size, size / word_size);
+            if (view != NULL){
+                return view;
+            }
+        }
+    }
+    char* buffer = tx -> viewBuffer(size);
+    if (!read(tx, source, size, buffer)){
+        return NULL;
+    }
+    return buffer;
+}
+
+
+template class DualStmEngine<0>;
+template class DualStmEngine<8>;
+template class DualStmEngine<16>;
+template class DualStmEngine<32>;
+template class DualStmEngine<64>;
+
+
+// allocates new segment with a recycled or fresh segment index, installs it in the segment table and adds it
+// to the allocated segments of the transaction. Its address is only known by the transaction until
+// it commits; if the transaction aborts, the batcher discards the segment at the end of the epoch.
+// Returns nomem if no segment index is left
+Alloc DualStm::alloc(Transaction* tx, std::size_t size, void ** target){
+    std::size_t index = takeSegmentIndex();
+    if (index == MAX_SEGMENTS){
+        return Alloc::nomem;
+    }
+    std::size_t start_address = index << SEGMENT_INDEX_SHIFT;
     DEBUG_MSG("Allocated segment at address: " << start_address);
     std::size_t num_words = size / alignment;
-    Segment* segment = new Segment(alignment, num_words, start_address);
-    tx -> addSegment(segment, start_address);
+    Segment* segment = Segment::create(arena, alignment, num_words, start_address, num_versions);
+    if (segment == NULL){
+        std::unique_lock<std::mutex> lock(index_mutex);
+        free_indices.push_back(index);
+        return Alloc::nomem;
+    }
+    segment_table[index].store(segment, std::memory_order_release);
+    tx -> allocated.push_back(segment);
     memcpy(target, &start_address, sizeof(void*));
-    return true;
+    return Alloc::success;
 }
 
 
@@ -168,12 +351,15 @@ bool DualStm::end(Transaction* tx){
 
 
 
-// used for debugging, checks that all the words have their state set
-// back to the initial one
-void DualStm::checkEpochEnd(){
-    for (auto it_s = segments.begin(); it_s != segments.end(); it_s++){
-        Segment* sg = it_s->second;
-        sg->checkEpochEnd();
+// used for debugging, checks that no word has an access state stamped
+// with an epoch later than the one that just ended
+void DualStm::checkEpochEnd(std::size_t epoch){
+    std::size_t num_indices = std::min(next_segment_index.load(), MAX_SEGMENTS);
+    for (std::size_t i = 1; i < num_indices; i++){
+        Segment* sg = segment_table[i].load();
+        if (sg != NULL){
+            sg->checkEpochEnd(epoch);
+        }
     }
 }
 
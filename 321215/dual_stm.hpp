@@ -1,9 +1,16 @@
 #ifndef DUAL_STM_H
 #define DUAL_STM_H
 
-#include <map>
 #include <cstddef>
+#include <cstdint>
 #include <atomic>
+#include <mutex>
+#include <vector>
+#include <tm.hpp>
+#include <tm_ext.hpp>
+#include "arena.hpp"
+#include "config.hpp"
+#include "update_op.hpp"
 
 class Segment;
 class Batcher;
@@ -11,15 +18,40 @@ class Transaction;
 
 // dual-versioned Software Transactional Memory
 class DualStm{
+    public:
+        // a shared address carries the index of its segment in the bits above SEGMENT_INDEX_SHIFT
+        // and the byte offset inside the segment below, so that it is translated to its segment
+        // with a shift and an index in segment_table
+        static constexpr unsigned SEGMENT_INDEX_SHIFT = 48;
+        static constexpr std::size_t OFFSET_MASK = (std::size_t(1) << SEGMENT_INDEX_SHIFT) - 1;
+        static constexpr std::size_t MAX_SEGMENTS = std::size_t(1) << (64 - SEGMENT_INDEX_SHIFT);
+
     private:
-        std::map<std::size_t, Segment*> segments;
-        // addresses[seg_end_address] returns start address of corresponding segment
-        std::map<std::size_t, std::size_t> addresses;
-        std::atomic<std::size_t> end_address{1};
+        // address space the segments are committed in
+        Arena arena;
+
+        // segment_table[i] is the segment with index i, NULL if not allocated (or freed).
+        // Index 0 is never used, so that no shared address is NULL
+        std::atomic<Segment*>* segment_table;
+
+        // next segment index never handed out
+        std::atomic<std::size_t> next_segment_index{1};
+
+        std::mutex index_mutex;
+        // indices of freed segments, handed out again before next_segment_index
+        std::vector<std::size_t> free_indices;
+
+        // takes a segment index, MAX_SEGMENTS if none is left
+        std::size_t takeSegmentIndex();
+
+        // removes segment from the segment table and recycles its index and its storage
+        void retireSegment(std::size_t index, Segment* segment);
 
     public:
         std::size_t alignment;
         std::size_t size_first_segment;
+        // committed versions kept per word in multi-version mode, 0 otherwise
+        std::size_t num_versions;
         
         // thread batcher, makes threads execute concurrently in batches and creates points in time
         // where no thread is running
@@ -27,26 +59,32 @@ class DualStm{
 
         // Create (i.e. allocate + init) a new shared memory region, with one first allocated segment of
         // the requested size and alignment.
-        // Initializes also the batcher
-        DualStm(std::size_t size, std::size_t alignment);
+        // Initializes also the batcher, which forms epochs following policy
+        DualStm(std::size_t size, std::size_t alignment, EpochPolicy const& policy);
+
+        // Create a new shared memory region with the engine specialized for the given alignment
+        // (8, 16, 32 or 64 bytes), or the generic engine for any other alignment.
+        // Returns NULL if the address space of the region cannot be reserved
+        static DualStm* create(std::size_t size, std::size_t alignment, EpochPolicy const& policy);
         
-        // deallocate all segments
-        ~DualStm();
+        // deallocate all segments (unmapped with the arena)
+        virtual ~DualStm();
 
-        // allocates new segment, increments atomically end_address and adds the segment to the allocated 
-        // segments in the transaction. If at the end the transaction is committed, the allocated segments are
-        // added to the STM by the batcher at the end of an epoch 
-        bool alloc(Transaction* tx, std::size_t size, void ** target);
+        // allocates new segment with a recycled or fresh segment index, installs it in the segment table and adds it
+        // to the allocated segments of the transaction. Its address is only known by the transaction until
+        // it commits; if the transaction aborts, the batcher discards the segment at the end of the epoch.
+        // Returns nomem if no segment index is left
+        Alloc alloc(Transaction* tx, std::size_t size, void ** target);
 
         // Get a pointer in shared memory to the first allocated segment of the shared memory region
         void* getHead();
 
-        // adds segment to segments, invoked by the batcher at the end of one epoch
-        // to add newly allocated segments by the committed transactions
-        void addSegment(std::size_t start_addr, Segment* segment);
+        // removes from the segment table and recycles a segment allocated by an aborted transaction,
+        // invoked by the batcher at the end of one epoch
+        void discardSegment(Segment* segment);
 
 
-        // deletes segment with address at start address, if not already deleted.
+        // recycles segment with address at start address, if not already freed.
         // invoked by the batcher at the end of one epoch
         void freeSegment(size_t start_address);
 
@@ -55,27 +93,60 @@ class DualStm{
             return size_first_segment;
         }
 
-        // returns segment with start_address <= address < end_address, looks in segment allocated 
-        // by the transaction and the ones already in the STM
-        Segment* findSegment(std::size_t address, Transaction* tx);
+        // returns segment with start_address <= address < end_address (NULL if it was freed),
+        // found by its index in the segment table (both for segments already in the STM and
+        // the ones allocated by the transaction)
+        Segment* findSegment(std::size_t address){
+            std::size_t index = address >> SEGMENT_INDEX_SHIFT;
+            if (index >= MAX_SEGMENTS){
+                return NULL;
+            }
+            return segment_table[index].load(std::memory_order_acquire);
+        }
 
         // Begin a new transaction on the given shared memory region. Adds transaction to the
-        // batcher
-        Transaction* begin(bool is_read_only);
+        // batcher, in an epoch of its own if exclusive
+        Transaction* begin(bool is_read_only, bool exclusive = false);
 
         // Read operation in a transaction
         // source is the start address
         // target is output buffer that has to be written
         // size: length to copy in bytes
         //Returns: true: the transaction can continue, false: the transaction has aborted
-        bool read(Transaction* tx, void const *  source, std::size_t size, void* target);
+        virtual bool read(Transaction* tx, void const *  source, std::size_t size, void* target) = 0;
 
         // Write operation in the transaction, source in a private region and target in the shared region.
         // source is the input buffer
         // size: length to copy in bytes
         // target: start address
         // Returns: true: the transaction can continue, false: the transaction has aborted
-        bool write(Transaction* tx, void const * source, std::size_t size, void * target);
+        virtual bool write(Transaction* tx, void const * source, std::size_t size, void * target) = 0;
+
+        // Vectored read/write operations: the count ranges are processed grouped by segment (in their order
+        // within one segment), each segment is looked up once, and the first conflict aborts the transaction
+        // Returns: true: the transaction can continue, false: the transaction has aborted
+        virtual bool readv(Transaction* tx, tm_iovec const* ranges, std::size_t count) = 0;
+
+        virtual bool writev(Transaction* tx, tm_iovec const* ranges, std::size_t count) = 0;
+
+        // Adds delta to the 64-bit integer at target in the transaction, without conflicting with the
+        // other transactions adding to it (see Segment::add). With words of another size than 8 bytes,
+        // falls back to reading and writing it
+        // Returns: true: the transaction can continue, false: the transaction has aborted
+        bool add(Transaction* tx, void* target, std::int64_t delta);
+
+        // Applies op to the 64-bit integer at target in the transaction, in one access instead of a read
+        // and a write (see Segment::update), and stores the value it had in old. With words smaller
+        // than 8 bytes, falls back to reading and writing it
+        // Returns: true: the transaction can continue, false: the transaction has aborted
+        virtual bool update(Transaction* tx, void* target, UpdateOp op, std::uint64_t operand, std::uint64_t expected,
+            std::uint64_t* old) = 0;
+
+        // Read view of size bytes from source in the transaction, valid until it ends: for a read-only transaction
+        // in an epoch, a pointer to the readable copy of the words if it is contiguous (see Segment::readView),
+        // otherwise a private copy of the words, read as by read()
+        // Returns: the view, NULL if the transaction has aborted
+        virtual void const* readView(Transaction* tx, void const* source, std::size_t size) = 0;
 
         // adds start_address of segment (contained in target) to list of segments to free in transaction
         bool free(Transaction* tx, void* target);
@@ -85,11 +156,43 @@ class DualStm{
         bool end(Transaction* tx);
         
 
-        // used for debugging, checks that all the words have their state set
-        // back to the initial one
-        void checkEpochEnd();
+        // used for debugging, checks that no word has an access state stamped
+        // with an epoch later than the one that just ended
+        void checkEpochEnd(std::size_t epoch);
+
+
+};
+
+
+// DualStm engine specialized on the word size W (0 for the generic engine, that uses
+// the runtime alignment). Word indices are computed with shifts and words are copied
+// with plain loads and stores of W bytes
+template <std::size_t W>
+class DualStmEngine : public DualStm{
+    private:
+        // reads (or writes) the ranges, see readv/writev
+        bool transferv(Transaction* tx, tm_iovec const* ranges, std::size_t count, bool writing);
+
+    public:
+        DualStmEngine(std::size_t size, std::size_t alignment, EpochPolicy const& policy):
+            DualStm(size, alignment, policy){};
+
+        bool read(Transaction* tx, void const *  source, std::size_t size, void* target) override;
+
+        bool write(Transaction* tx, void const * source, std::size_t size, void * target) override;
+
+        bool readv(Transaction* tx, tm_iovec const* ranges, std::size_t count) override{
+            return transferv(tx, ranges, count, false);
+        }
+
+        bool writev(Transaction* tx, tm_iovec const* ranges, std::size_t count) override{
+            return transferv(tx, ranges, count, true);
+        }
 
+        bool update(Transaction* tx, void* target, UpdateOp op, std::uint64_t operand, std::uint64_t expected,
+            std::uint64_t* old) override;
 
+        void const* readView(Transaction* tx, void const* source, std::size_t size) override;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#ifndef INLINE_VECTOR_H
+#define INLINE_VECTOR_H
+
+#include <cstddef>
+#include <string.h>
+#include <type_traits>
+
+// flat array of trivially copyable elements whose first N elements are stored inline
+// (e.g. in the Transaction descriptor), spilling over into a heap array when it grows larger.
+// The elements stay contiguous, and clear() keeps the heap array for the next use
+template <class T, std::size_t N>
+class InlineVector{
+    static_assert(std::is_trivially_copyable<T>::value, "InlineVector elements are copied with memcpy");
+
+    private:
+        T inline_elements[N];
+
+        // inline_elements, or the heap array once spilled over
+        T* elements = inline_elements;
+        std::size_t count = 0;
+        std::size_t capacity = N;
+
+        // moves the elements to a heap array twice as large
+        void grow(){
+            T* larger = new T[capacity * 2];
+            memcpy(larger, elements, count * sizeof(T));
+            if (elements != inline_elements){
+                delete[] elements;
+            }
+            elements = larger;
+            capacity *= 2;
+        }
+
+    public:
+        InlineVector() = default;
+
+        InlineVector(InlineVector const&) = delete;
+        InlineVector& operator=(InlineVector const&) = delete;
+
+        ~InlineVector(){
+            if (elements != inline_elements){
+                delete[] elements;
+            }
+        }
+
+        void push_back(T const& element){
+            if (count == capacity){
+                grow();
+            }
+            elements[count++] = element;
+        }
+
+        void clear(){
+            count = 0;
+        }
+
+        std::size_t size() const{
+            return count;
+        }
+
+        bool empty() const{
+            return count == 0;
+        }
+
+        T& operator[](std::size_t i){
+            return elements[i];
+        }
+
+        T* begin(){
+            return elements;
+        }
+
+        T* end(){
+            return elements + count;
+        }
+};
+
+#endif
@@ -1,63 +1,414 @@
 #include "segment.hpp"
 #include "word.hpp"
 #include "transaction.hpp"
+#include "debug.hpp"
+#include "bulk_copy.hpp"
+#include "arena.hpp"
+#include "config.hpp"
+#include <new>
+#include <thread>
+#include <algorithm>
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
 
-Segment::Segment(std::size_t i_alignment, std::size_t i_num_words, std::size_t i_start_address):
-        alignment(i_alignment), num_words(i_num_words), start_address(i_start_address)
+// rounds offset up to a multiple of alignment
+static std::size_t alignUp(std::size_t offset, std::size_t alignment){
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// offset of the control array from the start of the Segment object
+static std::size_t controlsOffset(){
+    return alignUp(sizeof(Segment), alignof(WordControl));
+}
+
+// offset of the copies from the start of the Segment object, aligned on the word size
+static std::size_t copiesOffset(std::size_t alignment, std::size_t num_words){
+    return alignUp(controlsOffset() + num_words * sizeof(WordControl), std::max(alignment, alignof(WordControl)));
+}
+
+// offset of the version slots from the start of the Segment object
+static std::size_t versionsOffset(std::size_t alignment, std::size_t num_words){
+    return alignUp(copiesOffset(alignment, num_words) + 2 * num_words * alignment, sizeof(std::uint64_t));
+}
+
+// bytes of one version slot: its tag followed by the value
+static std::size_t versionStride(std::size_t alignment){
+    return sizeof(std::uint64_t) + alignUp(alignment, sizeof(std::uint64_t));
+}
+
+Segment::Segment(std::size_t i_alignment, std::size_t i_num_words, std::size_t i_start_address, std::size_t i_num_versions):
+        alignment(i_alignment), num_words(i_num_words), start_address(i_start_address), num_versions(i_num_versions)
 {
-    words = new Word* [num_words];
-    std::size_t addr = start_address;
-    for (std::size_t i = 0; i < num_words; i++){
-        words[i] = new Word(alignment, addr);
-        addr += alignment;
-    }
+    // the arrays follow the Segment object; the memory is already zeroed, so the control
+    // words (and version tags) are not touched (the kernel only maps their pages on first access)
+    controls = reinterpret_cast<WordControl*>(reinterpret_cast<char*>(this) + controlsOffset());
+    copies = reinterpret_cast<char*>(this) + copiesOffset(alignment, num_words);
+    versions = reinterpret_cast<char*>(this) + versionsOffset(alignment, num_words);
+    version_stride = versionStride(alignment);
+}
+
+// bytes of arena used by a segment of num_words words of the given alignment
+std::size_t Segment::storageSize(std::size_t alignment, std::size_t num_words, std::size_t num_versions){
+    return versionsOffset(alignment, num_words) + num_words * num_versions * versionStride(alignment);
 }
 
-Segment::~Segment(){
-    for(std::size_t i = 0; i < num_words; i++){
-        delete words[i];
+// creates a segment in memory committed from arena, NULL if the arena is exhausted
+Segment* Segment::create(Arena& arena, std::size_t alignment, std::size_t num_words, std::size_t start_address,
+        std::size_t num_versions){
+    void* storage = arena.commit(storageSize(alignment, num_words, num_versions));
+    if (storage == NULL){
+        return NULL;
     }
-    delete[] words;
+    return new (storage) Segment(alignment, num_words, start_address, num_versions);
+}
+
+// gives the memory of segment back to arena
+void Segment::destroy(Arena& arena, Segment* segment){
+    std::size_t size = storageSize(segment->alignment, segment->num_words, segment->num_versions);
+    segment->~Segment();
+    arena.release(segment, size);
 }
 
 
+// a single word goes through Word::read. Larger ranges are processed in chunks of
+// BULK_CHUNK_WORDS words: the copy to read of every word of the chunk is selected first
+// (for read-write transactions that are not solo this is where the access protocol runs), then the chunk
+// is copied from copy_a or copy_b alone if all its words select the same one (as in readView),
+// otherwise gathered at once from both
+template <std::size_t W>
 bool Segment::read(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void* target){
+    if (tx -> snapshot){
+        return readSnapshot(start_word_idx, num_words, tx, target);
+    }
+    if (num_words == 1){
+        return word<W>(start_word_idx).read(tx, target);
+    }
+    std::size_t word_size = W != 0 ? W : alignment;
     char* out_buffer = static_cast<char*>(target);
+    std::uint64_t selectors[BULK_CHUNK_WORDS];
+    bool tracked = !tx -> is_read_only && !tx -> solo;
+    for (std::size_t chunk = 0; chunk < num_words; chunk += BULK_CHUNK_WORDS){
+        std::size_t chunk_words = std::min<std::size_t>(BULK_CHUNK_WORDS, num_words - chunk);
+        std::size_t first_idx = start_word_idx + chunk;
+        std::uint64_t any_selector = 0;
+        std::uint64_t all_selectors = ~std::uint64_t(0);
+        for (std::size_t i = 0; i < chunk_words; i++){
+            WordControl& control = controls[first_idx + i];
+            if (tracked){
+                if (!control.addToAccessSet(tx, false)){
+                    tx -> aborted = true;
+                    return false;
+                }
+            }
+            std::uint64_t state = control.state.load(std::memory_order_relaxed);
+            // the writer of a word reads its writable copy
+            bool written_by_tx = tracked && (WordControl::accessState(state, tx -> epoch) & WordControl::WRITTEN);
+            selectors[i] = written_by_tx ? (state ^ WordControl::COPY_B_READABLE) : state;
+            any_selector |= selectors[i];
+            all_selectors &= selectors[i];
+        }
+        char const* copy_a = copies + first_idx * word_size;
+        char const* copy_b = copy_a + this -> num_words * word_size;
+        if (((any_selector ^ all_selectors) & WordControl::COPY_B_READABLE) == 0){
+            char const* source = (all_selectors & WordControl::COPY_B_READABLE) ? copy_b : copy_a;
+            memcpy(out_buffer + chunk * word_size, source, chunk_words * word_size);
+        }
+        else{
+            BulkCopy<W>::gather(out_buffer + chunk * word_size, copy_a, copy_b, selectors, chunk_words, alignment);
+        }
+    }
+    return true;
+}
+
+// words are copied straight from source into the writable copies, without staging buffer.
+// A solo transaction writes the readable copies in place, one memcpy per run of words
+// whose readable copy is the same
+template <std::size_t W>
+bool Segment::write(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void const * source){
+    std::size_t word_size = W != 0 ? W : alignment;
+    char const* in_buffer = static_cast<char const*>(source);
+    if (tx -> solo){
+        std::size_t i = 0;
+        while (i < num_words){
+            bool copy_a_readable = controls[start_word_idx + i].isCopyAReadable();
+            std::size_t run_end = i + 1;
+            while (run_end < num_words && controls[start_word_idx + run_end].isCopyAReadable() == copy_a_readable){
+                run_end ++;
+            }
+            char* copy = copies + (start_word_idx + i) * word_size + (copy_a_readable ? 0 : this -> num_words * word_size);
+            memcpy(copy, in_buffer + i * word_size, (run_end - i) * word_size);
+            i = run_end;
+        }
+        tx -> has_written = true;
+        return true;
+    }
     for (std::size_t i = 0; i < num_words; i++){
-        std::size_t offset = i * alignment;
-        bool result = words[start_word_idx + i]->read(tx, out_buffer + offset);
+        std::size_t offset = i * word_size;
+        bool result = word<W>(start_word_idx + i).write(tx, in_buffer + offset);
         if (result == false){
             return false;
         }
+        recordVersioned(tx, start_word_idx + i);
     }
     return true;
 }
 
-bool Segment::write(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void const * source){
-    char* in_buffer = new char[num_words * alignment];
-    memcpy(in_buffer, source, num_words*alignment);
+
+// the first adder of the word in the epoch sets ADDED together with WRITTEN while it copies the
+// readable value into the writable copy, the next adders wait for it to clear WRITTEN
+// (spinning like the batcher's waiters, then yielding).
+// A word accessed by tx alone is claimed as written instead
+bool Segment::add(std::size_t idx, Transaction* tx, std::uint64_t delta){
+    WordControl& control = controls[idx];
+    std::uint64_t* copy_a = reinterpret_cast<std::uint64_t*>(copies) + idx;
+    std::uint64_t* copy_b = copy_a + num_words;
+    if (tx -> solo){
+        *(control.isCopyAReadable() ? copy_a : copy_b) += delta;
+        tx -> has_written = true;
+        return true;
+    }
+    std::uint64_t stamp = tx -> epoch & WordControl::EPOCH_MASK;
+    std::uint64_t tr_bits = std::uint64_t(tx -> tr_num) << WordControl::OWNER_SHIFT;
+    std::uint64_t cur_state = control.state.load(std::memory_order_acquire);
+    std::size_t spins = Config::get().wait_spins;
+    while (true){
+        std::uint64_t access = WordControl::accessState(cur_state, tx -> epoch);
+        bool copy_a_readable = (cur_state & WordControl::COPY_B_READABLE) == 0;
+        std::uint64_t* readable = copy_a_readable ? copy_a : copy_b;
+        std::uint64_t* writable = copy_a_readable ? copy_b : copy_a;
+        if (access == 0){
+            std::uint64_t new_state = WordControl::ADDED | WordControl::WRITTEN | tr_bits
+                | (cur_state & WordControl::COPY_B_READABLE) | stamp;
+            if (!control.state.compare_exchange_weak(cur_state, new_state, std::memory_order_acq_rel, std::memory_order_acquire)){
+                continue;
+            }
+            *writable = *readable + delta;
+            tx -> added.push_back({&control, writable, delta, this, idx, true, false});
+            control.state.fetch_and(~WordControl::WRITTEN, std::memory_order_release);
+            break;
+        }
+        if (access & WordControl::ADDED){
+            if (access & WordControl::WRITTEN){  // being initialized
+                if (spins > 0){
+                    spins --;
+                    #if defined(__x86_64__) || defined(__i386__)
+                    __builtin_ia32_pause();
+                    #endif
+                }
+                else{
+                    std::this_thread::yield();
+                }
+                cur_state = control.state.load(std::memory_order_acquire);
+                continue;
+            }
+            Transaction::AddedWord* entry = tx -> findAdded(&control);
+            if (entry == NULL){
+                if ((access & WordControl::ACCESSED_BY_MANY) == 0
+                        && !control.state.compare_exchange_weak(cur_state, cur_state | WordControl::ACCESSED_BY_MANY,
+                            std::memory_order_acq_rel, std::memory_order_acquire)){
+                    continue;
+                }
+                tx -> added.push_back({&control, writable, 0, this, idx, false, false});
+                entry = &tx -> added[tx -> added.size() - 1];
+            }
+            __atomic_fetch_add(writable, delta, __ATOMIC_RELAXED);
+            entry -> delta += delta;
+            break;
+        }
+        if ((access & WordControl::WRITTEN) && (access & WordControl::OWNER_MASK) == tr_bits){
+            *writable += delta;
+            break;
+        }
+        // accessed by tx alone (or conflicting): claimed as written
+        if (!control.addToAccessSet(tx, true)){
+            tx -> aborted = true;
+            return false;
+        }
+        recordVersioned(tx, idx);
+        *writable = *readable + delta;
+        break;
+    }
+    tx -> has_written = true;
+    return true;
+}
+
+
+// one access protocol run instead of a read followed by a write
+bool Segment::update(std::size_t idx, Transaction* tx, UpdateOp op, std::uint64_t operand, std::uint64_t expected,
+        std::uint64_t* old){
+    WordControl& control = controls[idx];
+    char* copy_a = copies + idx * alignment;
+    char* copy_b = copy_a + num_words * alignment;
+    if (tx -> solo){
+        std::uint64_t* readable = reinterpret_cast<std::uint64_t*>(control.isCopyAReadable() ? copy_a : copy_b);
+        *old = *readable;
+        *readable = applyUpdate(op, *old, operand, expected);
+        tx -> has_written = true;
+        return true;
+    }
+    // a word written by tx (or added to by tx alone, converted by addToAccessSet)
+    // holds the value tx sees in its writable copy
+    std::uint64_t access = WordControl::accessState(control.state.load(std::memory_order_acquire), tx -> epoch);
+    bool in_writable = (access & (WordControl::WRITTEN | WordControl::ADDED))
+        && (access & WordControl::OWNER_MASK) == (std::uint64_t(tx -> tr_num) << WordControl::OWNER_SHIFT);
+    if (!control.addToAccessSet(tx, true)){
+        tx -> aborted = true;
+        return false;
+    }
+    recordVersioned(tx, idx);
+    bool copy_a_readable = control.isCopyAReadable();
+    char* readable = copy_a_readable ? copy_a : copy_b;
+    char* writable = copy_a_readable ? copy_b : copy_a;
+    std::uint64_t* value = reinterpret_cast<std::uint64_t*>(writable);
+    if (in_writable){
+        *old = *value;
+    }
+    else{
+        *old = *reinterpret_cast<std::uint64_t*>(readable);
+        // the rest of a larger word keeps its value
+        memcpy(writable + sizeof(std::uint64_t), readable + sizeof(std::uint64_t), alignment - sizeof(std::uint64_t));
+    }
+    *value = applyUpdate(op, *old, operand, expected);
+    tx -> has_written = true;
+    return true;
+}
+
+
+// the readable-copy bits are compared at once, without a branch per word
+char const* Segment::readView(std::size_t start_word_idx, std::size_t num_words){
+    std::uint64_t any_state = 0;
+    std::uint64_t all_states = ~std::uint64_t(0);
     for (std::size_t i = 0; i < num_words; i++){
-        std::size_t offset = i * alignment;
-        bool result = words[start_word_idx + i]->write(tx, in_buffer + offset);
-        if (result == false){
+        std::uint64_t state = controls[start_word_idx + i].state.load(std::memory_order_relaxed);
+        any_state |= state;
+        all_states &= state;
+    }
+    if ((any_state ^ all_states) & WordControl::COPY_B_READABLE){
+        return NULL;
+    }
+    bool copy_a_readable = (all_states & WordControl::COPY_B_READABLE) == 0;
+    return copies + start_word_idx * alignment + (copy_a_readable ? 0 : this -> num_words * alignment);
+}
+
+
+// if word idx was just claimed as written by tx, its version is published when tx commits
+// (a word converted from added to written is already in versioned)
+void Segment::recordVersioned(Transaction* tx, std::size_t idx){
+    if (num_versions != 0 && tx -> versioned.size() < tx -> written.size()){
+        tx -> versioned.push_back({this, idx});
+    }
+}
+
+
+void Segment::writeVersion(char* slot, char const* value, std::uint64_t tag){
+    versionTag(slot).store(WRITING_VERSION, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot + sizeof(std::uint64_t), value, alignment);
+    versionTag(slot).store(tag, std::memory_order_release);
+}
+
+
+// the slots of a word are filled in order, so slot 0 is empty only if the word never had a version
+void Segment::publishVersion(std::size_t idx, std::size_t epoch){
+    char* ring = versions + idx * num_versions * version_stride;
+    char* copy_a = copies + idx * alignment;
+    char* copy_b = copy_a + num_words * alignment;
+    bool copy_a_readable = controls[idx].isCopyAReadable();
+    char const* readable = copy_a_readable ? copy_a : copy_b;
+    char const* writable = copy_a_readable ? copy_b : copy_a;
+
+    if (versionTag(ring).load(std::memory_order_relaxed) == NO_VERSION){
+        writeVersion(ring, readable, 1);
+        writeVersion(ring + version_stride, writable, epoch + 1);
+        return;
+    }
+    char* oldest = ring;
+    std::uint64_t oldest_tag = versionTag(ring).load(std::memory_order_relaxed);
+    for (std::size_t k = 1; k < num_versions; k++){
+        char* slot = ring + k * version_stride;
+        std::uint64_t tag = versionTag(slot).load(std::memory_order_relaxed);
+        if (tag < oldest_tag){
+            oldest = slot;
+            oldest_tag = tag;
+        }
+    }
+    writeVersion(oldest, writable, epoch + 1);
+}
+
+
+// the value of a word in the snapshot of epoch is its version with the latest epoch not after it.
+// A word without versions was never committed in multi-version mode: its readable copy is read,
+// then the read is valid if the word still has no version and its copies were not swapped
+bool Segment::readVersion(std::size_t idx, std::size_t epoch, char* target){
+    char* ring = versions + idx * num_versions * version_stride;
+    while (true){
+        if (versionTag(ring).load(std::memory_order_acquire) == NO_VERSION){
+            WordControl& control = controls[idx];
+            std::uint64_t state = control.state.load(std::memory_order_acquire);
+            char const* copy_a = copies + idx * alignment;
+            memcpy(target, (state & WordControl::COPY_B_READABLE) ? copy_a + num_words * alignment : copy_a, alignment);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (versionTag(ring).load(std::memory_order_relaxed) == NO_VERSION
+                    && ((control.state.load(std::memory_order_relaxed) ^ state) & WordControl::COPY_B_READABLE) == 0){
+                return true;
+            }
+            continue;
+        }
+        char* best = NULL;
+        std::uint64_t best_tag = NO_VERSION;
+        for (std::size_t k = 0; k < num_versions; k++){
+            char* slot = ring + k * version_stride;
+            std::uint64_t tag = versionTag(slot).load(std::memory_order_acquire);
+            if (tag != WRITING_VERSION && tag != NO_VERSION && tag - 1 <= epoch && tag > best_tag){
+                best = slot;
+                best_tag = tag;
+            }
+        }
+        if (best == NULL){
+            return false;
+        }
+        memcpy(target, best + sizeof(std::uint64_t), alignment);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (versionTag(best).load(std::memory_order_relaxed) == best_tag){
+            return true;
+        }
+        // overwritten meanwhile: by a later version, the next lookup fails
+    }
+}
+
+
+bool Segment::readSnapshot(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void* target){
+    char* out_buffer = static_cast<char*>(target);
+    for (std::size_t i = 0; i < num_words; i++){
+        if (!readVersion(start_word_idx + i, tx -> epoch, out_buffer + i * alignment)){
+            tx -> aborted = true;
             return false;
         }
     }
-    delete in_buffer;
     return true;
 }
 
 
-void Segment::checkEpochEnd(){
+template bool Segment::read<0>(std::size_t, std::size_t, Transaction*, void*);
+template bool Segment::read<8>(std::size_t, std::size_t, Transaction*, void*);
+template bool Segment::read<16>(std::size_t, std::size_t, Transaction*, void*);
+template bool Segment::read<32>(std::size_t, std::size_t, Transaction*, void*);
+template bool Segment::read<64>(std::size_t, std::size_t, Transaction*, void*);
+
+template bool Segment::write<0>(std::size_t, std::size_t, Transaction*, void const*);
+template bool Segment::write<8>(std::size_t, std::size_t, Transaction*, void const*);
+template bool Segment::write<16>(std::size_t, std::size_t, Transaction*, void const*);
+template bool Segment::write<32>(std::size_t, std::size_t, Transaction*, void const*);
+template bool Segment::write<64>(std::size_t, std::size_t, Transaction*, void const*);
+
+
+void Segment::checkEpochEnd(std::size_t epoch){
     for (size_t i = 0; i < num_words; i++){
-        Word * cur_word = words[i];
-        if ((cur_word->last_tx_accessed != 0) || 
-                (cur_word->accessed_by_many == true) || 
-                (cur_word->written == true)){
+        Word<0> cur_word = word<0>(i);
+        if (cur_word.lastEpochAccessed() > (epoch & WordControl::EPOCH_MASK)){
             
-            DEBUG_MSG("Word at address " << cur_word->addr << " has last_tx_accessed: " << cur_word->last_tx_accessed << " accessed by many: " << cur_word->accessed_by_many << " written: " << cur_word->written);
+            DEBUG_MSG("Word at address " << cur_word.addr << " has access state stamped with epoch " << cur_word.lastEpochAccessed() << " after end of epoch " << epoch);
             exit(2);
         }
     }
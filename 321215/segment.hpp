@@ -1,33 +1,123 @@
 #ifndef SEGMENT_H
 #define SEGMENT_H
 #include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include "word.hpp"
+#include "update_op.hpp"
 
-class Word;
 class Transaction;
+class Arena;
 
+// struct-of-arrays storage: one packed array of control metadata and two contiguous
+// arrays holding copy_a and copy_b of every word.
+// A Segment lives in the Arena of its shared memory region: the Segment object is followed
+// by its control array and its copies in one committed range, zeroed lazily by the kernel
+// (or, for a small segment, a zeroed block of a slab shared with other small segments)
+// (a zeroed control word is a stale access state with copy_a readable).
+// In multi-version mode the copies are followed by a ring of num_versions committed versions
+// per word, which read-only transactions read their snapshot from
 class Segment{
 
     private:
-        Word** words;
+        // controls[i] is the control metadata of word i
+        WordControl* controls;
+
+        // copies[0, num_words * alignment) holds copy_a of every word,
+        // copies[num_words * alignment, 2 * num_words * alignment) holds copy_b
+        char* copies;
+
+        // versions + (i * num_versions + k) * version_stride is version slot k of word i: an atomic
+        // tag (NO_VERSION if empty, WRITING_VERSION while written, otherwise 1 + the epoch at
+        // the end of which the version was committed) followed by the value of the word
+        char* versions;
+        std::size_t version_stride;
+        static constexpr std::uint64_t NO_VERSION = 0;
+        static constexpr std::uint64_t WRITING_VERSION = ~std::uint64_t(0);
+
+        std::atomic<std::uint64_t>& versionTag(char* slot){
+            return *reinterpret_cast<std::atomic<std::uint64_t>*>(slot);
+        }
+
+        // adds word idx to the versioned words of tx in multi-version mode, once tx claimed it as written
+        void recordVersioned(Transaction* tx, std::size_t idx);
+
+        // writes value in slot, seqlock-style, readers check the tag did not change
+        void writeVersion(char* slot, char const* value, std::uint64_t tag);
+
+        // reads the value of word idx in the snapshot of epoch, false if it is no longer kept
+        bool readVersion(std::size_t idx, std::size_t epoch, char* target);
+
+        // handle on word at index idx, W is the word size if known at compile time (0 otherwise)
+        template <std::size_t W>
+        Word<W> word(std::size_t idx){
+            std::size_t word_size = W != 0 ? W : alignment;
+            char* copy_a = copies + idx * word_size;
+            char* copy_b = copy_a + num_words * word_size;
+            return Word<W>(&controls[idx], copy_a, copy_b, alignment, start_address + idx * word_size);
+        }
 
     public:
         std::size_t alignment;
         std::size_t num_words;
         std::size_t start_address;
+        // committed versions kept per word, 0 if not in multi-version mode
+        std::size_t num_versions;
+
+        Segment(std::size_t i_alignment, std::size_t i_num_words, std::size_t i_start_address, std::size_t i_num_versions);
 
-        Segment(std::size_t i_alignment, std::size_t i_num_words, std::size_t i_start_address);
+        // bytes of arena used by a segment of num_words words of the given alignment
+        static std::size_t storageSize(std::size_t alignment, std::size_t num_words, std::size_t num_versions);
 
-        ~Segment();
+        // creates a segment in memory committed from arena, NULL if the arena is exhausted
+        static Segment* create(Arena& arena, std::size_t alignment, std::size_t num_words, std::size_t start_address,
+            std::size_t num_versions);
 
+        // gives the memory of segment back to arena
+        static void destroy(Arena& arena, Segment* segment);
+
+        // W is the word size if known at compile time, 0 otherwise. Instantiated for the
+        // word sizes of DualStm::create
         // Returns: true: the transaction can continue, false: the transaction has aborted
+        template <std::size_t W>
         bool read(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void* target);
         
         // Returns: true: the transaction can continue, false: the transaction has aborted
+        template <std::size_t W>
         bool write(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void const* source);
+
+        // adds delta to the 8-byte word idx (wrapping around), commutatively: the transactions adding
+        // to the same word in one epoch do not conflict, their deltas are summed in its writable copy
+        // and the copies are swapped at the end of the epoch. A word added to by several transactions
+        // can be neither read nor written by them in the epoch: they abort, only a single adder can read it back
+        // Returns: true: the transaction can continue, false: the transaction has aborted
+        bool add(std::size_t idx, Transaction* tx, std::uint64_t delta);
+
+        // applies op to the 64-bit integer at the start of word idx (of 8 bytes or more) as seen by tx, which
+        // claims the word as written (even if a compare-and-set leaves it unchanged), and stores the value it had in old
+        // Returns: true: the transaction can continue, false: the transaction has aborted
+        bool update(std::size_t idx, Transaction* tx, UpdateOp op, std::uint64_t operand, std::uint64_t expected,
+            std::uint64_t* old);
+
+        // readable copy of the words [start_word_idx, start_word_idx + num_words) if it is contiguous, i.e. if
+        // all their readable copies are in the same array, NULL otherwise. For read-only transactions in an
+        // epoch, whose readable copies do not change until it ends
+        char const* readView(std::size_t start_word_idx, std::size_t num_words);
+
+        // multi-version mode: records the value written in word idx (in its writable copy) as
+        // committed at the end of epoch, before the copies are swapped, in place of its oldest
+        // version. The first time, the value it had before is kept too, as committed at epoch 0
+        void publishVersion(std::size_t idx, std::size_t epoch);
+
+        // multi-version mode: reads words for a read-only transaction with a snapshot
+        // (Transaction::snapshot), which aborts if a version is no longer kept
+        bool readSnapshot(std::size_t start_word_idx, std::size_t num_words, Transaction* tx, void* target);
     
         
-        void checkEpochEnd();
+        // used for debugging, checks that no word has an access state stamped
+        // with an epoch later than the one that just ended
+        void checkEpochEnd(std::size_t epoch);
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -27,6 +27,7 @@
 // Internal headers
 
 #include <tm.hpp>
+#include <tm_ext.hpp>
 #include "word.hpp"
 #include "dual_stm.hpp"
 #include "macros.h"
@@ -34,6 +35,7 @@
 #include "segment.hpp"
 #include "transaction.hpp"
 #include "batcher.hpp"
+#include "config.hpp"
 #include <iostream>
 #include <string.h>
 
@@ -55,7 +57,25 @@ static size_t convertToInt(void const * a, size_t size){
  * @return Opaque shared memory region handle, 'invalid_shared' on failure
 **/
 shared_t tm_create(size_t size, size_t align) noexcept {
-    DualStm* stm = new DualStm(size, align);
+    DualStm* stm = DualStm::create(size, align, Config::get().epoch_policy);
+    return stm;
+}
+
+/** Create (i.e. allocate + init) a new shared memory region whose batcher forms epochs following the given policy.
+ * @param size  Size of the first shared segment of memory to allocate (in bytes), must be a positive multiple of the alignment
+ * @param align Alignment (in bytes, must be a power of 2) that the shared memory region must support
+ * @param policy Epoch formation policy, NULL for the one set in the environment (latency-first by default)
+ * @return Opaque shared memory region handle, 'invalid_shared' on failure
+**/
+shared_t tm_create_with_policy(size_t size, size_t align, tm_epoch_policy const* policy) noexcept {
+    if (policy == NULL){
+        return tm_create(size, align);
+    }
+    EpochPolicy epoch_policy;
+    epoch_policy.min_batch = policy -> min_batch;
+    epoch_policy.gathering_window_us = policy -> gathering_window_us;
+    epoch_policy.max_batch = policy -> max_batch;
+    DualStm* stm = DualStm::create(size, align, epoch_policy);
     return stm;
 }
 
@@ -106,6 +126,18 @@ tx_t tm_begin(shared_t shared, bool is_ro) noexcept{
     return res;
 }
 
+/** [thread-safe] Begin a new read-write transaction that runs alone in an epoch of its own:
+ * it never aborts, and the transactions begun after it run in the following epochs.
+ * @param shared Shared memory region to start a transaction on
+ * @return Opaque transaction ID, 'invalid_tx' on failure
+**/
+tx_t tm_begin_exclusive(shared_t shared) noexcept{
+    DualStm* stm = reinterpret_cast<DualStm*>(shared);
+    Transaction* tx = stm->begin(false, true);
+    tx_t res = reinterpret_cast<tx_t>(tx);
+    return res;
+}
+
 /** [thread-safe] End the given transaction.
  * @param shared Shared memory region associated with the transaction
  * @param tx     Transaction to end
@@ -162,6 +194,115 @@ bool tm_write(shared_t shared, tx_t tx, void const* source, size_t size, void* t
     return can_continue;
 }
 
+/** [thread-safe] Add operation in the given transaction: adds delta to the 64-bit integer at target.
+ * The transactions adding to the same integer in one epoch do not conflict with each other. Reading or writing
+ * the integer after adding to it only works for a transaction that is the single adder of the epoch: if another
+ * one added to it too, the read or write aborts (so tm_add does not fit a sequence generator that needs the
+ * value it assigned, use tm_update for that).
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @param target Address of the integer (in the shared region), aligned on 8 bytes and on the alignment
+ * @param delta  Value to add, wrapping around
+ * @return Whether the whole transaction can continue
+**/
+bool tm_add(shared_t shared, tx_t tx, void* target, int64_t delta) noexcept {
+    DualStm* stm = reinterpret_cast<DualStm*>(shared);
+    Transaction* t = reinterpret_cast<Transaction*>(tx);
+    bool can_continue = stm->add(t, target, delta);
+    if (!can_continue){
+       DEBUG_MSG("Transaction " << t->tr_num << " aborted when adding " << delta << " to address: " << reinterpret_cast<std::size_t>(target));
+    }
+    return can_continue;
+}
+
+/** [thread-safe] Read-modify-write operation in the given transaction on the 64-bit integer at target,
+ * equivalent to a read followed by a write of the integer but in one access.
+ * @param shared   Shared memory region associated with the transaction
+ * @param tx       Transaction to use
+ * @param target   Address of the integer (in the shared region), aligned on 8 bytes and on the alignment
+ * @param op       Operation to apply
+ * @param operand  Value added (tm_update_add) or stored (tm_update_exchange, tm_update_cas)
+ * @param expected Value the integer must have for tm_update_cas to store operand, ignored otherwise
+ * @param old      Private address receiving the value the integer had in the transaction
+ * @return Whether the whole transaction can continue
+**/
+bool tm_update(shared_t shared, tx_t tx, void* target, tm_update_op op, uint64_t operand, uint64_t expected,
+        uint64_t* old) noexcept {
+    DualStm* stm = reinterpret_cast<DualStm*>(shared);
+    Transaction* t = reinterpret_cast<Transaction*>(tx);
+    UpdateOp update_op;
+    switch (op){
+        case tm_update_add:
+            update_op = UpdateOp::ADD;
+            break;
+        case tm_update_exchange:
+            update_op = UpdateOp::EXCHANGE;
+            break;
+        default:
+            update_op = UpdateOp::COMPARE_AND_SET;
+            break;
+    }
+    bool can_continue = stm->update(t, target, update_op, operand, expected, old);
+    if (!can_continue){
+       DEBUG_MSG("Transaction " << t->tr_num << " aborted when updating address: " << reinterpret_cast<std::size_t>(target));
+    }
+    return can_continue;
+}
+
+/** [thread-safe] Vectored read operation in the given transaction: reads every range, from the shared
+ * region to a private region, as tm_read would (the ranges are grouped by segment before being read).
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @param ranges Ranges to read
+ * @param count  Number of ranges
+ * @return Whether the whole transaction can continue
+**/
+bool tm_readv(shared_t shared, tx_t tx, tm_iovec const* ranges, size_t count) noexcept {
+    DualStm* stm = reinterpret_cast<DualStm*>(shared);
+    Transaction* t = reinterpret_cast<Transaction*>(tx);
+    bool can_continue = stm->readv(t, ranges, count);
+    if (!can_continue){
+       DEBUG_MSG("Transaction " << t->tr_num << " aborted when reading " << count << " ranges");
+    }
+    return can_continue;
+}
+
+/** [thread-safe] Vectored write operation in the given transaction: writes every range, from a private
+ * region to the shared region, as tm_write would (overlapping ranges are written in their order).
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @param ranges Ranges to write
+ * @param count  Number of ranges
+ * @return Whether the whole transaction can continue
+**/
+bool tm_writev(shared_t shared, tx_t tx, tm_iovec const* ranges, size_t count) noexcept {
+    DualStm* stm = reinterpret_cast<DualStm*>(shared);
+    Transaction* t = reinterpret_cast<Transaction*>(tx);
+    bool can_continue = stm->writev(t, ranges, count);
+    if (!can_continue){
+       DEBUG_MSG("Transaction " << t->tr_num << " aborted when writing " << count << " ranges");
+    }
+    return can_continue;
+}
+
+/** [thread-safe] Zero-copy read operation in the given transaction: returns a view of the range, straight into
+ * the shared storage if possible (read-only transactions), otherwise into a private copy.
+ * @param shared Shared memory region associated with the transaction
+ * @param tx     Transaction to use
+ * @param source Source start address (in the shared region)
+ * @param size   Length of the range (in bytes), must be a positive multiple of the alignment
+ * @return Read-only view of the range, valid until tm_end, NULL if the transaction aborted
+**/
+void const* tm_read_view(shared_t shared, tx_t tx, void const* source, size_t size) noexcept {
+    DualStm* stm = reinterpret_cast<DualStm*>(shared);
+    Transaction* t = reinterpret_cast<Transaction*>(tx);
+    void const* view = stm->readView(t, source, size);
+    if (view == NULL){
+       DEBUG_MSG("Transaction " << t->tr_num << " aborted when reading a view of address: " << reinterpret_cast<std::size_t>(source));
+    }
+    return view;
+}
+
 /** [thread-safe] Memory allocation in the given transaction.
  * @param shared Shared memory region associated with the transaction
  * @param tx     Transaction to use
@@ -174,16 +315,13 @@ Alloc tm_alloc(shared_t shared, tx_t tx, size_t size, void** target) noexcept {
     Transaction* t = reinterpret_cast<Transaction*>(tx);
     //std::cout<<"Transaction " << t->tr_num << " epoch " << t->epoch <<" allocating segment of size " << size << "\n";
 
-    bool can_continue = stm -> alloc(t, size, target);
-    if (can_continue){
-        char addr[8];
-        memcpy(addr, target, 8);
-       // std::cout << "allocated segment of size "  << size << " at address " << convertToInt(addr, 8) << std::endl;
-        return Alloc(0);
+    Alloc result = stm -> alloc(t, size, target);
+    if (result == Alloc::success){
+       // std::cout << "allocated segment of size "  << size << " at address " << convertToInt(target, 8) << std::endl;
     }else{
        // std::cout << "Failed allocating segment\n";
-        return Alloc(1);
     }
+    return result;
 }
 
 
@@ -4,24 +4,142 @@
 
 
 // called at the end of an epoch for committed transaction
-// update content of written words, reset control structure of read/written words
+// swap readable/writable copy of written words
 void Transaction::commit(){
+    commit(0, written.size());
+}
+
+
+// swap readable/writable copy of the written words of indexes [begin, end)
+void Transaction::commit(std::size_t begin, std::size_t end){
     assert(aborted == false);
-    for (auto it = written.begin(); it != written.end(); it++){
-        it -> second -> updateWritten();
+    if (!versioned.empty()){
+        for (std::size_t i = begin; i < end; i++){
+            versioned[i].segment -> publishVersion(versioned[i].index, epoch);
+            written[i] -> updateWritten();
+        }
+        return;
     }
-    for (auto it = read.begin(); it != read.end(); it++){
-        it -> second -> resetState();
+    for (std::size_t i = begin; i < end; i++){
+        written[i] -> updateWritten();
+    }
+}
+
+
+// the data of a buffer does not move when view_buffers grows
+char* Transaction::viewBuffer(std::size_t size){
+    if (used_view_buffers == view_buffers.size()){
+        view_buffers.emplace_back();
     }
+    std::vector<char>& buffer = view_buffers[used_view_buffers++];
+    buffer.resize(size);
+    return buffer.data();
 }
 
-// reset control variables of written/read words
-void Transaction::abort(){
-    assert(aborted == true);
-    for (auto it = written.begin(); it != written.end(); it++){
-        it -> second -> resetState();
+
+Transaction::AddedWord* Transaction::findAdded(WordControl* control){
+    for (AddedWord& entry : added){
+        if (entry.control == control){
+            return &entry;
+        }
     }
-    for (auto it = read.begin(); it != read.end(); it++){
-        it -> second -> resetState();
+    return NULL;
+}
+
+
+// the writable copy already holds the readable value plus the deltas of this transaction
+void Transaction::convertAdded(WordControl* control){
+    AddedWord* entry = findAdded(control);
+    assert(entry != NULL && entry -> initializer);
+    entry -> converted = true;
+    written.push_back(control);
+    if (entry -> segment -> num_versions != 0){
+        versioned.push_back({entry -> segment, entry -> index});
+    }
+}
+
+
+// other adders may update the same writable copies concurrently
+void Transaction::undoAdds(){
+    for (AddedWord& entry : added){
+        if (!entry.converted){
+            __atomic_fetch_sub(entry.writable, entry.delta, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+// every transaction of the epoch has left, so the writable copies hold the deltas of
+// the committed adders only
+void Transaction::flipAdded(){
+    for (AddedWord& entry : added){
+        if (entry.initializer && !entry.converted){
+            if (entry.segment -> num_versions != 0){
+                entry.segment -> publishVersion(entry.index, epoch);
+            }
+            entry.control -> updateWritten();
+        }
     }
-}
\ No newline at end of file
+}
+
+
+// descriptors of one thread; the thread is their only user between acquire and release,
+// the batcher releases them at the end of the epoch
+struct TransactionPool{
+    std::vector<Transaction*> descriptors;
+
+    // descriptors still used by the batcher are orphaned and deleted by release
+    ~TransactionPool(){
+        for (Transaction* tx : descriptors){
+            if (tx -> pool_state.exchange(Transaction::ORPHANED, std::memory_order_acq_rel) == Transaction::FREE){
+                delete tx;
+            }
+        }
+    }
+};
+
+static thread_local TransactionPool pool;
+
+
+void Transaction::reset(std::size_t i_epoch, bool i_is_read_only, std::size_t i_tr_num){
+    epoch = i_epoch;
+    is_read_only = i_is_read_only;
+    tr_num = i_tr_num;
+    has_written = false;
+    aborted = false;
+    self_commit = false;
+    solo = false;
+    snapshot = false;
+    allocated.clear();
+    freed.clear();
+    written.clear();
+    versioned.clear();
+    added.clear();
+    used_view_buffers = 0;
+}
+
+
+// takes a free descriptor of the calling thread (allocates one only if none is free)
+// and resets it, clearing its sets but keeping their capacity
+Transaction* Transaction::acquire(std::size_t epoch, bool is_read_only, std::size_t tr_num){
+    for (Transaction* tx : pool.descriptors){
+        if (tx -> pool_state.load(std::memory_order_acquire) == FREE){
+            tx -> pool_state.store(IN_USE, std::memory_order_relaxed);
+            tx -> reset(epoch, is_read_only, tr_num);
+            return tx;
+        }
+    }
+    Transaction* tx = new Transaction(epoch, is_read_only, tr_num);
+    pool.descriptors.push_back(tx);
+    return tx;
+}
+
+
+// gives a descriptor back to the pool of the thread that acquired it, once the batcher
+// is done with it. Deletes it if that thread has exited in the meantime
+void Transaction::release(Transaction* tx){
+    if (tx -> pool_state.exchange(FREE, std::memory_order_acq_rel) == ORPHANED){
+        delete tx;
+    }
+}
+
@@ -1,14 +1,16 @@
 #ifndef TRANSACTION_h
 #define TRANSACTION_h
 
-#include "segment.hpp"
-#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
 #include <vector>
+#include "inline_vector.hpp"
 #include "debug.hpp"
 #include "assert.h"
 
 class Segment;
-class Word;
+struct WordControl;
 
 class Transaction{
 
@@ -17,12 +19,9 @@ class Transaction{
 
         std::size_t epoch;        
 
-        // allocated[start_address] returns the corresponding Segment
-        std::map<std::size_t, Segment*> allocated;
-
-        // allocated_end_addresses[end_address] returns the start_address of the corresponding
-        // Segment
-        std::map<std::size_t, size_t> allocated_end_addresses;
+        // segments allocated by the transaction, already installed in the segment table of the STM
+        // (their address is only known by the transaction until it commits)
+        std::vector<Segment*> allocated;
 
         // start address of freed vectors
         std::vector<std::size_t> freed;
@@ -32,61 +31,114 @@ class Transaction{
         // identifier of the transaction, unique for each transaction in one epoch
         std::size_t tr_num;
 
-        std::map<std::size_t, Word*> written;
-
-        std::map<std::size_t, Word*> read;
+        // number of written words tracked inline in the descriptor, short transactions
+        // never touch the heap to track their writes
+        static constexpr std::size_t INLINE_WRITTEN = 16;
+
+        // control words of the words written by the transaction, each added once, when the
+        // transaction claims it (so no lookup is needed), and walked linearly at commit.
+        // Words that were only read need no tracking:
+        // their access state is stamped with the epoch and becomes stale when it ends
+        InlineVector<WordControl*, INLINE_WRITTEN> written;
+
+        // word of a segment, by index
+        struct VersionedWord{
+            Segment* segment;
+            std::size_t index;
+        };
+
+        // multi-version mode: the words of written (in the same order), whose versions
+        // are published when the transaction commits
+        InlineVector<VersionedWord, INLINE_WRITTEN> versioned;
+
+        // word the transaction added to (see Segment::add) and the sum of its deltas.
+        // The first adder of a word in the epoch initialized its writable copy, it swaps the
+        // copies at the end of the epoch (whether it committed or not), unless the word was
+        // converted into one written by it
+        struct AddedWord{
+            WordControl* control;
+            std::uint64_t* writable;
+            std::uint64_t delta;
+            Segment* segment;
+            std::size_t index;
+            bool initializer;
+            bool converted;
+        };
+
+        InlineVector<AddedWord, INLINE_WRITTEN> added;
+
+        // private copies handed out by tm_read_view, valid until the transaction ends. The first
+        // used_view_buffers are in use, the others are kept (with their capacity) for the next views
+        std::vector<std::vector<char>> view_buffers;
+        std::size_t used_view_buffers = 0;
+
+        // multi-version mode: read-only transaction outside of any epoch, reading the snapshot
+        // of the words at the end of epoch `epoch`, pinned in the batcher's slot pin_slot
+        bool snapshot = false;
+        std::size_t pin_slot = 0;
 
         bool aborted = false;
 
+        // the transaction is alone in its epoch (no other one, not even read-only, runs
+        // concurrently) so it cannot conflict and never aborts: it reads and writes the
+        // readable copies in place, without claiming words, and has nothing to swap at commit
+        bool solo = false;
 
-        void addSegment(Segment* segment, std::size_t start_address){
-            allocated[start_address] = segment;
-            std::size_t end_address = start_address + (segment->num_words * segment->alignment);
-            allocated_end_addresses[end_address] = start_address;
-        }
-
-        // return Segment that has start_addr < address < end_address
-        // NULL if the transaction did not allocate such Segment
-        Segment* findSegment(std::size_t addr){
-            // finds lowest end address that is greater than addr
-            auto iterator = allocated_end_addresses.upper_bound(addr);
-            if (iterator == allocated_end_addresses.end()){
-                return NULL;
-            }
-            std::size_t start_addr = iterator -> second;
-
+        // the transaction swaps its written words itself once its epoch is closed
+        // (instead of the thread closing the epoch)
+        bool self_commit = false;
 
-            if (addr >= start_addr){
-                return allocated[start_addr];
-            }
-            else{
-                return NULL;
-            }
+        // next transaction in the batcher's list of transactions that left the epoch
+        Transaction* next_ended = nullptr;
 
-        }
 
         // called at the end of an epoch for committed transaction
-        // update content of written words, reset control structure of read/written words
+        // swap readable/writable copy of written words
         void commit();
 
-        // reset control variables of written/read words
-        void abort();
+        // same for the written words of indexes [begin, end) only, so that the words of one
+        // transaction can be swapped by several threads
+        void commit(std::size_t begin, std::size_t end);
+
+        // a private buffer of size bytes, valid until the transaction ends
+        char* viewBuffer(std::size_t size);
+
+        // entry of the word of control in added, NULL if the transaction did not add to it
+        AddedWord* findAdded(WordControl* control);
+
+        // the word of control, added to by this transaction only, was claimed as written by it
+        void convertAdded(WordControl* control);
+
+        // aborted transaction takes its deltas back out of the writable copies,
+        // before leaving its epoch
+        void undoAdds();
+
+        // at the end of the epoch, swaps the copies of the words this transaction initialized
+        // (publishing their version in multi-version mode)
+        void flipAdded();
 
         Transaction(std::size_t i_epoch, bool is_read_only, std::size_t tr_num): 
             epoch(i_epoch), is_read_only(is_read_only), tr_num(tr_num){};
 
-        // if transaction was committed don't destroy allocated segments, as they are added to the STM
-        // if transaction was not committed (aborted = true), destroy allocated segments
-        // do not destroy written words, because some of them may be already allocated in the STM
-        // and the ones that are not are destroyed with allocated segments
-        ~Transaction(){
-            //DEBUG_MSG("Inside destructor of transaction: " << tr_num);
-            if (aborted){
-                for (auto it = allocated.begin(); it != allocated.end(); it++){
-                    delete it -> second;
-                }
-            }
-        }
+        // Transaction descriptors are pooled per thread and reused across epochs:
+        // takes a free descriptor of the calling thread (allocates one only if none is free)
+        // and resets it, clearing its sets but keeping their capacity
+        static Transaction* acquire(std::size_t epoch, bool is_read_only, std::size_t tr_num);
+
+        // gives a descriptor back to the pool of the thread that acquired it, once the batcher
+        // is done with it. Deletes it if that thread has exited in the meantime
+        static void release(Transaction* tx);
+
+    private:
+        friend struct TransactionPool;
+
+        enum PoolState { IN_USE, FREE, ORPHANED };
+
+        // IN_USE from acquire to release, FREE while in the pool, ORPHANED if the owning thread
+        // exited while the descriptor was still in use
+        std::atomic<PoolState> pool_state{IN_USE};
+
+        void reset(std::size_t i_epoch, bool i_is_read_only, std::size_t i_tr_num);
 
 };
 
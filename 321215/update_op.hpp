@@ -0,0 +1,26 @@
+#ifndef UPDATE_OP_H
+#define UPDATE_OP_H
+
+#include <cstdint>
+
+// read-modify-write operation applied by tm_update to a 64-bit integer
+enum class UpdateOp{
+    ADD,                // value + operand, wrapping around
+    EXCHANGE,           // operand
+    COMPARE_AND_SET     // operand if value == expected, value otherwise
+};
+
+// value of the integer after op is applied to value
+inline std::uint64_t applyUpdate(UpdateOp op, std::uint64_t value, std::uint64_t operand, std::uint64_t expected){
+    switch (op){
+        case UpdateOp::ADD:
+            return value + operand;
+        case UpdateOp::EXCHANGE:
+            return operand;
+        case UpdateOp::COMPARE_AND_SET:
+            return value == expected ? operand : value;
+    }
+    return value;
+}
+
+#endif
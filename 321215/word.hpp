@@ -2,65 +2,219 @@
 #define WORD_H
 
 #include <atomic>
-#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <string.h>
+#include "transaction.hpp"
+
+// control metadata of one word, stored contiguously in the Segment
+// (one entry per word, the two copies live in separate arrays).
+// All the control fields are packed in a single 64-bit atomic, so that the access
+// protocol can be run with compare-and-swap instead of a per-word mutex:
+//   bit  63      : copy_b is readable (otherwise copy_a is)
+//   bit  62      : word written in the epoch
+//   bit  61      : word accessed by many transactions in the epoch
+//   bit  60      : word added to (tm_add) in the epoch, see Segment::add
+//   bits 40..59  : identifier of the last transaction that accessed the word in the epoch
+//                  (of the first one that added to it)
+//   bits 0..39   : epoch the access state belongs to
+// An access state stamped with an earlier epoch counts as reset, so the state of the
+// words does not need to be cleared at the end of each epoch.
+struct WordControl{
+    static constexpr std::uint64_t COPY_B_READABLE = std::uint64_t(1) << 63;
+    static constexpr std::uint64_t WRITTEN = std::uint64_t(1) << 62;
+    static constexpr std::uint64_t ACCESSED_BY_MANY = std::uint64_t(1) << 61;
+    static constexpr std::uint64_t ADDED = std::uint64_t(1) << 60;
+    static constexpr unsigned OWNER_SHIFT = 40;
+    static constexpr std::uint64_t OWNER_MASK = (ADDED - 1) & ~((std::uint64_t(1) << OWNER_SHIFT) - 1);
+    static constexpr std::uint64_t EPOCH_MASK = (std::uint64_t(1) << OWNER_SHIFT) - 1;
+    // largest transaction identifier that fits in the owner field
+    static constexpr std::size_t MAX_TR_NUM = OWNER_MASK >> OWNER_SHIFT;
+
+    std::atomic<std::uint64_t> state{0};
+
+    // access state of the word as seen in epoch, i.e. without the readable-copy bit
+    // and reset if it was stamped in an earlier epoch
+    static std::uint64_t accessState(std::uint64_t state, std::size_t epoch){
+        if ((state & EPOCH_MASK) != (epoch & EPOCH_MASK)){
+            return 0;
+        }
+        return state & ~(COPY_B_READABLE | EPOCH_MASK);
+    }
+
+    static std::size_t owner(std::uint64_t access_state){
+        return (access_state & OWNER_MASK) >> OWNER_SHIFT;
+    }
+
+    bool isCopyAReadable() const{
+        return (state.load(std::memory_order_relaxed) & COPY_B_READABLE) == 0;
+    }
+
+    // runs the access protocol with compare-and-swap on the control word,
+    // adds tx to the "access set" of the word (and the word to the written set of tx).
+    // Returns: false if the access conflicts with another transaction, true otherwise
+    bool addToAccessSet(Transaction* tx, bool writing);
+
+    // swap readable/writable copy of a word written in a committed transaction,
+    // the access state becomes stale as soon as the epoch ends
+    void updateWritten(){
+        state.fetch_xor(COPY_B_READABLE, std::memory_order_relaxed);
+    }
+};
+
+
+// copy routine of one word. W is the word size known at compile time, so that the copy
+// becomes plain loads and stores; W = 0 is the generic version using the runtime alignment
+template <std::size_t W>
+struct WordCopy{
+    static void copy(void* target, void const* source, std::size_t){
+        memcpy(target, source, W);
+    }
+};
+
+template <>
+struct WordCopy<0>{
+    static void copy(void* target, void const* source, std::size_t alignment){
+        memcpy(target, source, alignment);
+    }
+};
 
-class Transaction;
 
+// lightweight handle on one word of a Segment: points to its control metadata
+// and to its slot in the copy_a/copy_b arrays.
+// W is the word size if known at compile time, 0 otherwise (see WordCopy)
+template <std::size_t W>
 class Word{
     private:
-        std::mutex word_mutex;
-        std::mutex access_set_mutex;
+        WordControl* control;
 
         char * copy_a;
         char * copy_b;
 
         // if readable=True read readable copy
         // else read the writable one
-        void readCopy(void* target, bool readable);
+        void readCopy(void* target, bool readable){
+            if (readable == control -> isCopyAReadable()){
+                WordCopy<W>::copy(target, copy_a, alignment);
+            }
+            else{
+                WordCopy<W>::copy(target, copy_b, alignment);
+            }
+        }
 
-        // write content of buffer source into writable copy
-        void writeCopy(void const* source);
+        // write content of buffer source into writable copy (or readable copy if writable is false)
+        void writeCopy(void const* source, bool writable){
+            if(control -> isCopyAReadable() != writable){
+                WordCopy<W>::copy(copy_a, source, alignment);
+            }else{
+                WordCopy<W>::copy(copy_b, source, alignment);
+            }
+        }
 
 
     public:
-        // if is_copy_a_readable = true, then copy_a is readable, otherwise copy_b
-        bool is_copy_a_readable = true;
-
         std::size_t alignment;
         std::size_t addr;
 
-        // identifier of the last transaction that accessed the word 
-        // valid identifiers range from 1 to n
-        std::atomic_ulong last_tx_accessed{0};
-
-        // whether the word was read/written by multiple transactions
-        std::atomic_bool accessed_by_many{false};
-
-        std::atomic_bool written{false};
-
-        explicit Word(std::size_t i_alignment, std::size_t addr);
-
-        ~Word(){
-            delete[] copy_a;
-            delete[] copy_b;
+        Word(WordControl* i_control, char* i_copy_a, char* i_copy_b, std::size_t i_alignment, std::size_t i_addr):
+            control(i_control), copy_a(i_copy_a), copy_b(i_copy_b), alignment(i_alignment), addr(i_addr){};
+
+        bool read(Transaction* tx, void* target){
+            if (tx -> is_read_only || tx -> solo){
+                readCopy(target, true);
+                return true;
+            }
+            // tx is not read_only
+            if (!control -> addToAccessSet(tx, false)){
+                tx->aborted = true;
+                return false;
+            }
+            // the only transaction allowed to access a written word is its writer
+            std::uint64_t access = WordControl::accessState(control -> state.load(std::memory_order_relaxed), tx -> epoch);
+            bool written_by_tx = (access & WordControl::WRITTEN) != 0;
+            readCopy(target, !written_by_tx);
+            return true;
         }
 
-        bool read(Transaction* tx, void* target);
-
-        bool write(Transaction* tx, void const* source);
-
-        void addToAccessSet(Transaction* tx, bool writing);
-
-
-        // reset the access set and written condition
-        void resetState();
+        bool write(Transaction* tx, void const* source){
+            if (tx -> solo){
+                writeCopy(source, false);
+                tx -> has_written = true;
+                return true;
+            }
+            if (!control -> addToAccessSet(tx, true)){
+                tx -> aborted = true;
+                return false;
+            }
+            // write content at source into the writable copy
+            writeCopy(source, true);
+            tx->has_written = true;
+            return true;
+        }
 
-        // reset the access set and written condition, swap readable/writable copy
-        void updateWritten();
+        // epoch the access state of the word was stamped with
+        std::size_t lastEpochAccessed() const{
+            return control->state.load() & WordControl::EPOCH_MASK;
+        }
 
+};
 
 
-};
+// add transaction to "access set" if not already in.
+// A read is refused if the word was written by another transaction, a write is refused
+// if the word was written or accessed by any other transaction.
+// A word added to by tx alone becomes written by it (its writable copy already holds
+// readable + the delta of tx), a word added to by another transaction is refused
+inline bool WordControl::addToAccessSet(Transaction* tx, bool writing){
+    std::uint64_t stamp = (tx -> epoch & EPOCH_MASK);
+    std::uint64_t tr_bits = std::uint64_t(tx -> tr_num) << OWNER_SHIFT;
+    std::uint64_t cur_state = state.load(std::memory_order_acquire);
+    while (true){
+        std::uint64_t access = accessState(cur_state, tx -> epoch);
+        std::uint64_t owner = access & OWNER_MASK;
+        std::uint64_t new_state;
+        if (access & ADDED){
+            // tx is the first adder and (without ACCESSED_BY_MANY) the only one,
+            // WRITTEN is set while the first adder initializes the writable copy
+            if ((access & (WRITTEN | ACCESSED_BY_MANY)) || owner != tr_bits){
+                return false;
+            }
+            new_state = WRITTEN | tr_bits | (cur_state & COPY_B_READABLE) | stamp;
+            if (state.compare_exchange_weak(cur_state, new_state, std::memory_order_acq_rel, std::memory_order_acquire)){
+                tx -> convertAdded(this);
+                return true;
+            }
+            continue;
+        }
+        if (access & WRITTEN){
+            // only the writer can access a written word, and it is already in the access set
+            return owner == tr_bits;
+        }
+        if (writing){
+            if ((access & ACCESSED_BY_MANY) || (owner != 0 && owner != tr_bits)){
+                return false;
+            }
+            new_state = WRITTEN | tr_bits;
+        }
+        else{
+            if (owner == tr_bits){  // already in the access set
+                return true;
+            }
+            new_state = tr_bits;
+            if (owner != 0){
+                new_state |= ACCESSED_BY_MANY;
+            }
+        }
+        new_state |= (cur_state & COPY_B_READABLE) | stamp;
+        if (state.compare_exchange_weak(cur_state, new_state, std::memory_order_acq_rel, std::memory_order_acquire)){
+            break;
+        }
+    }
+    if (writing){
+        tx -> written.push_back(this);
+    }
+    return true;
+}
 
 
-#endif
\ No newline at end of file
+#endif
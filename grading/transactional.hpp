@@ -32,6 +32,7 @@ extern "C" {
 // Internal headers
 namespace STM {
 #include <tm.hpp>
+#include <tm_ext.hpp>
 }
 #include "common.hpp"
 
@@ -80,6 +81,8 @@ private:
     using FnWrite   = decltype(&STM::tm_write);
     using FnAlloc   = decltype(&STM::tm_alloc);
     using FnFree    = decltype(&STM::tm_free);
+    using FnReadV   = decltype(&STM::tm_readv);
+    using FnWriteV  = decltype(&STM::tm_writev);
 private:
     void*     module;     // Module opaque handler
     FnCreate  tm_create;  // Module's initialization function
@@ -93,6 +96,8 @@ private:
     FnWrite   tm_write;   // Module's shared memory write function
     FnAlloc   tm_alloc;   // Module's shared memory allocation function
     FnFree    tm_free;    // Module's shared memory freeing function
+    FnReadV   tm_readv;   // Module's vectored shared memory read function (optional, null if not exported)
+    FnWriteV  tm_writev;  // Module's vectored shared memory write function (optional, null if not exported)
 private:
     /** Solve a symbol from its name, and bind it to the given function.
      * @param name Name of the symbol to resolve
@@ -107,6 +112,14 @@ private:
     template<class Signature> void solve(char const* name, Signature& func) const {
         func = solve<Signature>(name);
     }
+    /** Solve an optional symbol from its name, and bind it to the given function (null if not found).
+     * @param name Name of the symbol to resolve
+     * @param func Target function to bind
+    **/
+    template<class Signature> void solve_optional(char const* name, Signature& func) const {
+        auto res = ::dlsym(module, name);
+        func = res ? *reinterpret_cast<Signature*>(&res) : nullptr;
+    }
 public:
     /** Loader constructor.
      * @param path  Path to the library to load
@@ -132,6 +145,8 @@ public:
             solve("tm_write", tm_write);
             solve("tm_alloc", tm_alloc);
             solve("tm_free", tm_free);
+            solve_optional("tm_readv", tm_readv);
+            solve_optional("tm_writev", tm_writev);
         }
     }
     /** Unloader destructor.
@@ -240,6 +255,36 @@ public:
     auto write(TX tx, void const* source, size_t size, void* target) const noexcept {
         return tl.tm_write(shared, tx, source, size, target);
     }
+    /** [thread-safe] Vectored read operation in the given transaction, with one call if the library exports 'tm_readv'.
+     * @param tx     Transaction to use
+     * @param ranges Ranges to read (shared source, private target)
+     * @param count  Number of ranges
+     * @return Whether the whole transaction can continue
+    **/
+    bool readv(TX tx, STM::tm_iovec const* ranges, size_t count) const noexcept {
+        if (tl.tm_readv)
+            return tl.tm_readv(shared, tx, ranges, count);
+        for (size_t i = 0; i < count; ++i) {
+            if (!tl.tm_read(shared, tx, ranges[i].shared, ranges[i].size, ranges[i].priv))
+                return false;
+        }
+        return true;
+    }
+    /** [thread-safe] Vectored write operation in the given transaction, with one call if the library exports 'tm_writev'.
+     * @param tx     Transaction to use
+     * @param ranges Ranges to write (private source, shared target)
+     * @param count  Number of ranges
+     * @return Whether the whole transaction can continue
+    **/
+    bool writev(TX tx, STM::tm_iovec const* ranges, size_t count) const noexcept {
+        if (tl.tm_writev)
+            return tl.tm_writev(shared, tx, ranges, count);
+        for (size_t i = 0; i < count; ++i) {
+            if (!tl.tm_write(shared, tx, ranges[i].priv, ranges[i].size, ranges[i].shared))
+                return false;
+        }
+        return true;
+    }
     /** [thread-safe] Memory allocation operation in the given transaction, throw if no memory available.
      * @param tx     Transaction to use
      * @param size   Size to allocate
@@ -327,6 +372,28 @@ public:
             throw Exception::TransactionRetry{};
         }
     }
+    /** [thread-safe] Vectored read operation in the bound transaction.
+     * @param ranges Ranges to read (shared source, private target)
+     * @param count  Number of ranges
+    **/
+    void readv(STM::tm_iovec const* ranges, size_t count) {
+        if (unlikely(!tm.readv(tx, ranges, count))) {
+            aborted = true;
+            throw Exception::TransactionRetry{};
+        }
+    }
+    /** [thread-safe] Vectored write operation in the bound transaction.
+     * @param ranges Ranges to write (private source, shared target)
+     * @param count  Number of ranges
+    **/
+    void writev(STM::tm_iovec const* ranges, size_t count) {
+        if (unlikely(assert_mode && is_ro))
+            throw Exception::TransactionReadOnly{};
+        if (unlikely(!tm.writev(tx, ranges, count))) {
+            aborted = true;
+            throw Exception::TransactionRetry{};
+        }
+    }
     /** [thread-safe] Memory allocation operation in the bound transaction, throw if no memory available.
      * @param size Size to allocate
      * @return Target start address
@@ -360,6 +427,71 @@ public:
 
 // -------------------------------------------------------------------------- //
 
+/** Batch of reads and writes of one transaction, queued through the 'Shared' entries (opt-in)
+ * and issued on flush in the queued order, with one vectored call per run of consecutive reads or writes.
+ * The queue is stored inline and flushed by itself when full.
+**/
+class SharedBatch final: private NonCopyable {
+public:
+    static constexpr size_t capacity = 16; // Maximum number of queued ranges
+private:
+    struct Queued {
+        STM::tm_iovec range; // Shared and private ranges
+        bool is_write;       // Whether the range is written (read otherwise)
+    };
+    Transaction& tx; // Bound transaction
+    Queued queue[capacity]; // Queued reads and writes, in order
+    size_t count = 0; // Number of queued ranges
+public:
+    /** Binding constructor.
+     * @param tx Bound transaction
+    **/
+    SharedBatch(Transaction& tx): tx{tx} {}
+public:
+    /** Queue a read, its target is only filled by the next flush.
+     * @param source Source start address
+     * @param size   Source/target range
+     * @param target Target start address
+    **/
+    void read(void const* source, size_t size, void* target) {
+        if (count == capacity)
+            flush();
+        queue[count++] = Queued{STM::tm_iovec{const_cast<void*>(source), target, size}, false};
+    }
+    /** Queue a write, its source must stay valid until the next flush.
+     * @param source Source start address
+     * @param size   Source/target range
+     * @param target Target start address
+    **/
+    void write(void const* source, size_t size, void* target) {
+        if (count == capacity)
+            flush();
+        queue[count++] = Queued{STM::tm_iovec{target, const_cast<void*>(source), size}, true};
+    }
+    /** Issue the queued reads and writes in order, so a read queued after a write sees it.
+    **/
+    void flush() {
+        STM::tm_iovec run[capacity]; // Ranges of the current run, contiguous for the vectored call
+        size_t first = 0;
+        while (first < count) {
+            size_t length = 0;
+            while (first + length < count && queue[first + length].is_write == queue[first].is_write) {
+                run[length] = queue[first + length].range;
+                ++length;
+            }
+            if (queue[first].is_write) {
+                tx.writev(run, length);
+            } else {
+                tx.readv(run, length);
+            }
+            first += length;
+        }
+        count = 0;
+    }
+};
+
+// -------------------------------------------------------------------------- //
+
 /** Shared read/write helper class.
  * @param Type Specified type (array)
 **/
@@ -406,6 +538,20 @@ public:
     void operator=(Type const& source) const {
         return write(source);
     }
+    /** Queued read operation.
+     * @param batch  Batch to queue the read in
+     * @param target Private content filled on the next flush of the batch
+    **/
+    void read(SharedBatch& batch, Type& target) const {
+        batch.read(address, sizeof(Type), &target);
+    }
+    /** Queued write operation.
+     * @param batch  Batch to queue the write in
+     * @param source Private content to write at the shared address, kept until the next flush of the batch
+    **/
+    void write(SharedBatch& batch, Type const& source) const {
+        batch.write(&source, sizeof(Type), address);
+    }
 public:
     /** Address of the first byte after the entry.
      * @return First byte after the entry
@@ -0,0 +1,48 @@
+/**
+ * @file   tm_ext.hpp
+ *
+ * @section DESCRIPTION
+ *
+ * Extensions to the interface of tm.hpp implemented by the dual-versioned STM.
+ * Regions created with tm_create can be used with every function below.
+**/
+
+#pragma once
+
+#include <tm.hpp>
+
+// -------------------------------------------------------------------------- //
+
+// How the batcher forms epochs. A zeroed policy is latency-first: the next epoch starts as soon
+// as the previous one ends, with every thread waiting for it, and there is no limit on its size
+struct tm_epoch_policy {
+    size_t min_batch;           // Threads to gather before starting the next epoch (if at least one waits)...
+    size_t gathering_window_us; // ...for at most this many microseconds
+    size_t max_batch;           // Transactions admitted to one epoch, 0 for no limit
+};
+
+// Read-modify-write operations of tm_update on a 64-bit integer
+enum tm_update_op {
+    tm_update_add,      // value + operand, wrapping around
+    tm_update_exchange, // operand
+    tm_update_cas       // operand if value == expected, value otherwise
+};
+
+// One range of tm_readv/tm_writev
+struct tm_iovec {
+    void*  shared;  // Start address in the shared region (source of tm_readv, target of tm_writev)
+    void*  priv;    // Start address in a private region (target of tm_readv, source of tm_writev)
+    size_t size;    // Length of the range (in bytes), a positive multiple of the alignment
+};
+
+// -------------------------------------------------------------------------- //
+
+extern "C" {
+    shared_t tm_create_with_policy(size_t, size_t, tm_epoch_policy const*) noexcept;
+    tx_t     tm_begin_exclusive(shared_t) noexcept;
+    bool     tm_add(shared_t, tx_t, void*, int64_t) noexcept;
+    bool     tm_update(shared_t, tx_t, void*, tm_update_op, uint64_t, uint64_t, uint64_t*) noexcept;
+    bool     tm_readv(shared_t, tx_t, tm_iovec const*, size_t) noexcept;
+    bool     tm_writev(shared_t, tx_t, tm_iovec const*, size_t) noexcept;
+    void const* tm_read_view(shared_t, tx_t, void const*, size_t) noexcept;
+}